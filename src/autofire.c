@@ -0,0 +1,352 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+// Turbo, autorepeat and macros: synthetic key states sent to the virtual
+// joystick in between the ones coming from the M8. Everything is scheduled on
+// a single timerfd that the main loop waits on together with the serial port.
+// Edges are computed from the time each key went down rather than from the
+// previous edge, so a late wakeup doesn't push the following ones back and
+// keys pressed together with the same rate stay in phase. Keys sharing a rule
+// still have a phase of their own: a key pressed while another one of the
+// rule is in its released half period goes through straight away.
+
+#include "autofire.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "stats.h"
+#include "timing.h"
+#include "virtualjoystick.h"
+
+#define AUTOFIRE_MAX_RULES 8
+#define AUTOFIRE_MAX_MACROS 8
+#define AUTOFIRE_MAX_STEPS 32
+// faster rates would need edges closer than a millisecond apart
+#define AUTOFIRE_MAX_HZ 500
+// timer lateness is kept for this many wakeups for the report
+#ifdef M8JS_FIXED_FOOTPRINT
+#define AUTOFIRE_LATENESS_SAMPLES 2048
+#else
+#define AUTOFIRE_LATENESS_SAMPLES 65536
+#endif
+#define AUTOFIRE_NO_DEADLINE UINT64_MAX
+
+// Keys in the mask are held for delay_ns after going down, then released and
+// pressed again once per period. Turbo is the case where the delay is half a period.
+struct autofire_rule {
+    uint8_t mask;
+    uint64_t delay_ns;
+    uint64_t half_period_ns;
+    // keys of the mask that are down and when each of them went down
+    uint8_t held;
+    uint64_t pressed_at[8];
+};
+
+// Plays the key states in steps, step_ns each, when the keys go down to exactly the trigger
+struct autofire_macro {
+    uint8_t trigger;
+    uint64_t step_ns;
+    uint8_t steps[AUTOFIRE_MAX_STEPS];
+    int step_count;
+};
+
+static struct {
+    struct autofire_rule rules[AUTOFIRE_MAX_RULES];
+    int rule_count;
+    struct autofire_macro macros[AUTOFIRE_MAX_MACROS];
+    int macro_count;
+    int timer_fd;
+    uint8_t physical;
+    uint8_t sent;
+    // trigger keys of a finished macro, kept back until they are released
+    uint8_t suppressed;
+    const struct autofire_macro *playing;
+    uint64_t macro_started_at;
+    uint64_t deadline;
+    latency_stats_s lateness;
+} autofire = {.timer_fd = -1, .deadline = AUTOFIRE_NO_DEADLINE};
+
+/**
+ * Parses an unsigned number from the start of a string.
+ *
+ * @param s The string.
+ * @param base Number base as for strtoul(), 0 accepts hexadecimal key masks.
+ * @param max Largest accepted value.
+ * @param value Set to the parsed number.
+ * @return Returns a pointer to the first character after the number, or NULL if there is no valid number.
+ */
+static const char *parse_number(const char *s, const int base, const uint32_t max, uint32_t *value) {
+    char *end;
+    const unsigned long n = strtoul(s, &end, base);
+    if (end == s || n > max)
+        return NULL;
+    *value = n;
+    return end;
+}
+
+static int add_rule(const uint32_t mask, const uint32_t delay_ms, const uint32_t hz) {
+    if (mask == 0 || hz == 0 || autofire.rule_count >= AUTOFIRE_MAX_RULES)
+        return 0;
+
+    struct autofire_rule *rule = &autofire.rules[autofire.rule_count++];
+    rule->mask = mask;
+    rule->half_period_ns = 500000000ull / hz;
+    rule->delay_ns = delay_ms > 0 ? (uint64_t) delay_ms * 1000000ull : rule->half_period_ns;
+    return 1;
+}
+
+/**
+ * Adds a turbo rule: while held, the keys are pressed and released at a fixed rate.
+ *
+ * @param spec The rule as MASK:HZ, e.g. 0x01:15 for EDIT at 15 presses per second.
+ * @return Returns 1 on success, 0 if the rule is invalid.
+ */
+int autofire_add_turbo(const char *spec) {
+    uint32_t mask, hz;
+    const char *s = parse_number(spec, 0, 0xFF, &mask);
+    if (s == NULL || *s++ != ':' || (s = parse_number(s, 10, AUTOFIRE_MAX_HZ, &hz)) == NULL || *s != '\0' ||
+        !add_rule(mask, 0, hz)) {
+        fprintf(stderr, "Invalid turbo rule '%s', expected MASK:HZ\n", spec);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Adds an autorepeat rule: keys held longer than the delay are pressed again at a fixed rate.
+ *
+ * @param spec The rule as MASK:DELAY_MS:HZ, e.g. 0xE4:300:20 for the directions.
+ * @return Returns 1 on success, 0 if the rule is invalid.
+ */
+int autofire_add_autorepeat(const char *spec) {
+    uint32_t mask, delay_ms, hz;
+    const char *s = parse_number(spec, 0, 0xFF, &mask);
+    if (s == NULL || *s++ != ':' || (s = parse_number(s, 10, 60000, &delay_ms)) == NULL || *s++ != ':' ||
+        (s = parse_number(s, 10, AUTOFIRE_MAX_HZ, &hz)) == NULL || *s != '\0' || delay_ms == 0 ||
+        !add_rule(mask, delay_ms, hz)) {
+        fprintf(stderr, "Invalid autorepeat rule '%s', expected MASK:DELAY_MS:HZ\n", spec);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Adds a macro that plays a sequence of key states when the keys go down to exactly the trigger.
+ * The trigger keys are kept back after the macro until they are released.
+ *
+ * @param spec The macro as TRIGGER:STEP_MS:STATE[,STATE...], e.g. 0x81:30:0x10,0x50,0x10,0x00.
+ * @return Returns 1 on success, 0 if the macro is invalid.
+ */
+int autofire_add_macro(const char *spec) {
+    struct autofire_macro macro = {0};
+    uint32_t trigger, step_ms;
+    const char *s = parse_number(spec, 0, 0xFF, &trigger);
+    if (s == NULL || *s++ != ':' || (s = parse_number(s, 10, 60000, &step_ms)) == NULL || *s++ != ':')
+        s = NULL;
+
+    while (s != NULL && macro.step_count < AUTOFIRE_MAX_STEPS) {
+        uint32_t state;
+        s = parse_number(s, 0, 0xFF, &state);
+        if (s == NULL)
+            break;
+        macro.steps[macro.step_count++] = state;
+        if (*s == '\0')
+            break;
+        if (*s++ != ',')
+            s = NULL;
+    }
+
+    if (s == NULL || *s != '\0' || trigger == 0 || step_ms == 0 || autofire.macro_count >= AUTOFIRE_MAX_MACROS) {
+        fprintf(stderr, "Invalid macro '%s', expected TRIGGER:STEP_MS:STATE[,STATE...] with up to %d states\n",
+                spec, AUTOFIRE_MAX_STEPS);
+        return 0;
+    }
+    macro.trigger = trigger;
+    macro.step_ns = (uint64_t) step_ms * 1000000ull;
+    autofire.macros[autofire.macro_count++] = macro;
+    return 1;
+}
+
+/**
+ * Creates the timer if any rules or macros were added.
+ *
+ * @return Returns 1 on success, 0 otherwise.
+ */
+int autofire_init() {
+    if (autofire.rule_count == 0 && autofire.macro_count == 0)
+        return 1;
+
+    autofire.timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (autofire.timer_fd < 0) {
+        perror("timerfd_create");
+        return 0;
+    }
+    if (!latency_stats_init(&autofire.lateness, AUTOFIRE_LATENESS_SAMPLES)) {
+        close(autofire.timer_fd);
+        autofire.timer_fd = -1;
+        return 0;
+    }
+
+    fprintf(stderr, "Autofire enabled with %d repeating keys and %d macros\n", autofire.rule_count,
+            autofire.macro_count);
+    return 1;
+}
+
+int autofire_enabled() { return autofire.timer_fd >= 0; }
+
+int autofire_get_fd() { return autofire.timer_fd; }
+
+/**
+ * Works out the key state to send at the given time.
+ *
+ * @param now Time in CLOCK_MONOTONIC nanoseconds.
+ * @param next_edge Set to the time the key state changes next, or AUTOFIRE_NO_DEADLINE.
+ * @return Returns the key state.
+ */
+static uint8_t keys_at(const uint64_t now, uint64_t *next_edge) {
+    *next_edge = AUTOFIRE_NO_DEADLINE;
+
+    if (autofire.playing != NULL) {
+        const uint64_t step = (now - autofire.macro_started_at) / autofire.playing->step_ns;
+        if (step < (uint64_t) autofire.playing->step_count) {
+            *next_edge = autofire.macro_started_at + (step + 1) * autofire.playing->step_ns;
+            return autofire.playing->steps[step];
+        }
+        autofire.suppressed = autofire.playing->trigger & autofire.physical;
+        autofire.playing = NULL;
+    }
+
+    uint8_t keys = autofire.physical & ~autofire.suppressed;
+    const uint8_t unmodified = keys;
+    for (int i = 0; i < autofire.rule_count; i++) {
+        const struct autofire_rule *rule = &autofire.rules[i];
+        for (int bit = 0; bit < 8; bit++) {
+            const uint8_t key = 1 << bit;
+            if ((rule->held & unmodified & key) == 0)
+                continue;
+
+            const uint64_t held_for = now - rule->pressed_at[bit];
+            uint64_t edge;
+            if (held_for < rule->delay_ns) {
+                edge = rule->pressed_at[bit] + rule->delay_ns;
+            } else {
+                // released during the even half periods after the delay, pressed during the odd ones
+                const uint64_t half_periods = (held_for - rule->delay_ns) / rule->half_period_ns;
+                if (half_periods % 2 == 0)
+                    keys &= ~key;
+                edge = rule->pressed_at[bit] + rule->delay_ns + (half_periods + 1) * rule->half_period_ns;
+            }
+            if (edge < *next_edge)
+                *next_edge = edge;
+        }
+    }
+    return keys;
+}
+
+static void arm_timer(const uint64_t deadline) {
+    if (deadline == autofire.deadline)
+        return;
+    autofire.deadline = deadline;
+
+    // an all zero value disarms the timer
+    struct itimerspec spec = {0};
+    if (deadline != AUTOFIRE_NO_DEADLINE) {
+        spec.it_value.tv_sec = deadline / 1000000000ull;
+        spec.it_value.tv_nsec = deadline % 1000000000ull;
+    }
+    if (timerfd_settime(autofire.timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) != 0)
+        perror("timerfd_settime");
+}
+
+/**
+ * Sends the key state for the given time if it differs from the last one sent, and sets the
+ * timer for the next change.
+ *
+ * @return Returns 1 if the state was sent or didn't change, 0 if writing it failed.
+ */
+static int send_keys(const uint64_t now, const uint64_t timestamp_ns) {
+    uint64_t next_edge;
+    const uint8_t keys = keys_at(now, &next_edge);
+    arm_timer(next_edge);
+
+    if (keys == autofire.sent)
+        return 1;
+    autofire.sent = keys;
+    return send_virtual_joystick_message(keys, timestamp_ns);
+}
+
+/**
+ * Takes a key state from the M8 and passes it on to the virtual joystick with the rules and
+ * macros applied.
+ *
+ * @param keys The key state reported by the M8.
+ * @param timestamp_ns Arrival time of the joypad state packet, the phase of keys going down is aligned to it.
+ * @return Returns 1 if the resulting state was written, otherwise returns 0.
+ */
+int autofire_on_key_state(const uint8_t keys, const uint64_t timestamp_ns) {
+    for (int i = 0; i < autofire.rule_count; i++) {
+        struct autofire_rule *rule = &autofire.rules[i];
+        const uint8_t pressed = keys & rule->mask & ~rule->held;
+        for (int bit = 0; bit < 8; bit++) {
+            if (pressed & 1 << bit)
+                rule->pressed_at[bit] = timestamp_ns;
+        }
+        rule->held = keys & rule->mask;
+    }
+
+    if (autofire.playing == NULL && keys != autofire.physical) {
+        for (int i = 0; i < autofire.macro_count; i++) {
+            if (keys == autofire.macros[i].trigger) {
+                autofire.playing = &autofire.macros[i];
+                autofire.macro_started_at = timestamp_ns;
+                break;
+            }
+        }
+    }
+
+    autofire.physical = keys;
+    autofire.suppressed &= keys;
+    return send_keys(monotonic_ns(), timestamp_ns);
+}
+
+/**
+ * Sends the synthetic key state that is due, if any. Called from the main loop after waiting
+ * on the timer and after reading from the serial port.
+ */
+void autofire_poll() {
+    if (autofire.deadline == AUTOFIRE_NO_DEADLINE)
+        return;
+    const uint64_t now = monotonic_ns();
+    if (now < autofire.deadline)
+        return;
+
+    // the timer is always set again below, which also clears its expiration count
+    const uint64_t deadline = autofire.deadline;
+    latency_stats_add(&autofire.lateness, now - deadline);
+    metrics_inc(autofire_wakeups);
+    metrics_add(autofire_lateness_ns, now - deadline);
+
+    const uint8_t before = autofire.sent;
+    send_keys(now, deadline);
+    if (autofire.sent != before)
+        metrics_inc(synthetic_key_states);
+}
+
+/**
+ * Prints how late the synthetic key states were sent compared to their schedule.
+ */
+void autofire_report() {
+    if (autofire_enabled())
+        latency_stats_print(&autofire.lateness, "Autofire timer lateness", stderr);
+}
+
+void autofire_destroy() {
+    if (!autofire_enabled())
+        return;
+    close(autofire.timer_fd);
+    autofire.timer_fd = -1;
+    latency_stats_free(&autofire.lateness);
+}
@@ -1,11 +1,19 @@
 // Copyright 2021 Jonne Kokkonen
 // Released under the MIT licence, https://opensource.org/licenses/MIT
 
+#include "autofire.h"
 #include "command.h"
+#include "demand.h"
+#include "display.h"
+#include "journal.h"
+#include "metrics.h"
+#include "probe.h"
+#include "scope.h"
+#include "textgrid.h"
+#include "trace.h"
 #include "virtualjoystick.h"
 
 #include <stdio.h>
-#include <string.h>
 
 enum m8_command_bytes {
     draw_rectangle_command = 0xFE,
@@ -22,18 +30,9 @@ enum m8_command_bytes {
     system_info_command_datalength = 6
 };
 
-/**
- * Decodes a 16-bit integer from a byte array starting at a specified position.
- *
- * This function takes a pointer to a byte array and an offset, combining two
- * adjacent bytes starting from the given position to form a 16-bit integer.
- *
- * @param data Pointer to the byte array containing the data.
- * @param start Offset position in the byte array to start decoding.
- * @return Returns the decoded 16-bit integer value.
- */
-static uint16_t decodeInt16(const uint8_t *data, const uint8_t start) {
-    return data[start] | (uint16_t) data[start + 1] << 8;
+static void count_frame(const enum metrics_frame_type type, const uint32_t size) {
+    metrics_inc(frames[type]);
+    metrics_add(frame_bytes[type], size);
 }
 
 static void dump_packet(const uint32_t size, const uint8_t *recv_buf) {
@@ -43,6 +42,8 @@ static void dump_packet(const uint32_t size, const uint8_t *recv_buf) {
     fprintf(stderr, "\n");
 }
 
+static int dispatch_command(uint8_t *data, uint32_t size, uint64_t timestamp_ns);
+
 /**
  * Processes incoming command packets and handles them based on their type.
  *
@@ -53,16 +54,25 @@ static void dump_packet(const uint32_t size, const uint8_t *recv_buf) {
  *
  * @param data Pointer to the packet data.
  * @param size Size of the packet data.
- * @return Returns 1 if the command was successfully processed, 0 otherwise.
+ * @param timestamp_ns Arrival time of the packet's last byte in CLOCK_MONOTONIC nanoseconds.
+ * @return Returns 1 if the packet was well formed, 0 if it was not and should count as invalid.
  */
-int process_command(uint8_t *data, uint32_t size) {
-    uint8_t rx_buffer[size + 1];
+int process_command(uint8_t *data, uint32_t size, uint64_t timestamp_ns) {
+    trace_begin(TRACE_PROCESS_COMMAND);
+    const int result = dispatch_command(data, size, timestamp_ns);
+    trace_end(TRACE_PROCESS_COMMAND);
+    return result;
+}
 
-    memcpy(rx_buffer, data, size);
-    rx_buffer[size] = 0;
+static int dispatch_command(uint8_t *data, uint32_t size, uint64_t timestamp_ns) {
+    // the packet is handled in place in the SLIP buffer
+    const uint8_t *rx_buffer = data;
+    if (size == 0)
+        return 0;
 
     switch (rx_buffer[0]) {
         case joypad_keypressedstate_command: {
+            count_frame(METRICS_FRAME_JOYPAD, size);
             if (size != joypad_keypressedstate_command_datalength) {
                 printf(
                     "Invalid joypad keypressed state packet: expected length %d, "
@@ -72,25 +82,38 @@ int process_command(uint8_t *data, uint32_t size) {
                 return 0;
             }
 
-            if (send_virtual_joystick_message(rx_buffer[1])) {
+            metrics_set(joypad_state, rx_buffer[1]);
+
+            if (probe_is_running()) {
+                probe_on_joypad_state(rx_buffer[1], timestamp_ns);
                 return 1;
             }
-            return 0;
+
+            const int sent = autofire_enabled() ? autofire_on_key_state(rx_buffer[1], timestamp_ns)
+                                                : send_virtual_joystick_message(rx_buffer[1], timestamp_ns);
+            // a failed uinput write is counted and journalled as such, the packet itself was fine
+            journal_key_state(rx_buffer[1], timestamp_ns, sent ? 0 : JOURNAL_UINPUT_FAILED);
+            return 1;
         }
 
         case system_info_command: {
+            count_frame(METRICS_FRAME_SYSTEM_INFO, size);
             if (size != system_info_command_datalength) {
                 fprintf(stderr,
                         "Invalid system info packet: expected length %d, got %d\n",
                         system_info_command_datalength, size);
                 dump_packet(size, rx_buffer);
-                break;
+                return 0;
             }
 
             const char *hw_type[4] = {"Headless", "Beta M8", "Production M8", "Production M8 Model:02"};
 
             static int system_info_printed = 0;
 
+            display_queue_packet(rx_buffer, size, timestamp_ns);
+            textgrid_set_hardware(rx_buffer[1]);
+            scope_set_hardware(rx_buffer[1]);
+
             if (system_info_printed == 0) {
                 fprintf(stderr, "** Hardware info ** Device type: %s, Firmware ver %d.%d.%d\n", hw_type[rx_buffer[1]],
                         rx_buffer[2], rx_buffer[3], rx_buffer[4]);
@@ -99,13 +122,52 @@ int process_command(uint8_t *data, uint32_t size) {
 
             return 1;
         }
+        // Screen data is skipped while nothing reads it. Text and waveforms go straight into the text
+        // grid and the scope tap, the display mirror draws everything on its own thread
         case draw_character_command:
+            count_frame(METRICS_FRAME_CHARACTER, size);
+            if (size != draw_character_command_datalength) {
+                fprintf(stderr, "Invalid draw character packet: expected length %d, got %d\n",
+                        draw_character_command_datalength, size);
+                dump_packet(size, rx_buffer);
+                return 0;
+            }
+            if (!demand_consumers_attached())
+                break;
+            textgrid_draw_character(rx_buffer, timestamp_ns);
+            display_queue_packet(rx_buffer, size, timestamp_ns);
+            break;
         case draw_oscilloscope_waveform_command:
+            count_frame(METRICS_FRAME_OSCILLOSCOPE, size);
+            if (size < draw_oscilloscope_waveform_command_mindatalength ||
+                size > draw_oscilloscope_waveform_command_maxdatalength) {
+                fprintf(stderr, "Invalid draw oscilloscope packet: expected length %d-%d, got %d\n",
+                        draw_oscilloscope_waveform_command_mindatalength,
+                        draw_oscilloscope_waveform_command_maxdatalength, size);
+                dump_packet(size, rx_buffer);
+                return 0;
+            }
+            if (!demand_consumers_attached())
+                break;
+            scope_push(rx_buffer, size, timestamp_ns);
+            display_queue_packet(rx_buffer, size, timestamp_ns);
+            break;
         case draw_rectangle_command:
-            // These are not needed
+            count_frame(METRICS_FRAME_RECTANGLE, size);
+            if (size < draw_rectangle_command_min_datalength || size > draw_rectangle_command_max_datalength) {
+                fprintf(stderr, "Invalid draw rectangle packet: expected length %d-%d, got %d\n",
+                        draw_rectangle_command_min_datalength, draw_rectangle_command_max_datalength, size);
+                dump_packet(size, rx_buffer);
+                return 0;
+            }
+            if (!demand_consumers_attached())
+                break;
+            textgrid_draw_rectangle(rx_buffer, size);
+            display_queue_packet(rx_buffer, size, timestamp_ns);
             break;
 
         default:
+            count_frame(METRICS_FRAME_UNKNOWN, size);
             fprintf(stderr, "Invalid packet");
             dump_packet(size, rx_buffer);
             return 0;
@@ -0,0 +1,77 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+// Keeps track of whether anything is reading the screen data m8js publishes,
+// see demand.h for what consumers do. Full screen redraws are only
+// requested from the M8 while a consumer is attached, as nothing else needs
+// them and they hold up the key state packets on the serial link.
+
+#include "demand.h"
+
+#include <stdio.h>
+#include <sys/file.h>
+
+#include "metrics.h"
+#include "serial.h"
+#include "timing.h"
+
+#define DEMAND_MAX_FDS 4
+#define DEMAND_POLL_INTERVAL_NS (DEMAND_POLL_INTERVAL_MS * 1000000ull)
+
+static struct {
+    int fds[DEMAND_MAX_FDS];
+    int fd_count;
+    int attached;
+    uint64_t next_poll;
+} demand;
+
+/**
+ * Adds a shared memory segment to check for consumers.
+ *
+ * @param fd File descriptor of the segment, kept open by its owner.
+ */
+void demand_watch(const int fd) {
+    if (demand.fd_count < DEMAND_MAX_FDS)
+        demand.fds[demand.fd_count++] = fd;
+}
+
+/**
+ * Checks whether another process holds a lock on a segment.
+ */
+static int has_consumer(const int fd) {
+    if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+        flock(fd, LOCK_UN);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Returns 1 if any consumer was attached at the last check, otherwise 0.
+ */
+int demand_consumers_attached() { return demand.attached; }
+
+/**
+ * Checks for consumers a few times per second. When the first one attaches, the display is
+ * reset so that it gets a complete screen. Called from the main loop.
+ */
+void demand_poll() {
+    if (demand.fd_count == 0)
+        return;
+
+    const uint64_t now = monotonic_ns();
+    if (now < demand.next_poll)
+        return;
+    demand.next_poll = now + DEMAND_POLL_INTERVAL_NS;
+
+    int attached = 0;
+    for (int i = 0; i < demand.fd_count && !attached; i++)
+        attached = has_consumer(demand.fds[i]);
+
+    if (attached != demand.attached) {
+        fprintf(stderr, attached ? "Screen consumer attached\n" : "No screen consumers left\n");
+        demand.attached = attached;
+        metrics_set(display_consumers, attached);
+        if (attached)
+            enable_and_reset_display();
+    }
+}
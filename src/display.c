@@ -0,0 +1,397 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+// Headless display mirror. Draw packets are only copied into a queue on the
+// serial thread; a display thread rasterises them into a private canvas and
+// publishes a frame into shared memory at most 60 times per second, along
+// with the regions that changed since the previous frame.
+
+#include "display.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "command.h"
+#include "demand.h"
+#include "font.h"
+#include "footprint.h"
+#include "screen.h"
+#include "shm.h"
+
+// Bytes of queued packets, must be a power of two
+#define DISPLAY_QUEUE_SIZE (1 << 20)
+#define DISPLAY_FRAME_INTERVAL_NS 16666667
+#define DISPLAY_MAX_PACKET_SIZE 484
+
+struct queued_packet {
+    uint64_t timestamp_ns;
+    uint32_t size;
+    uint32_t reserved;
+};
+
+static struct {
+    struct display_header *shm;
+    int fd;
+    char name[64];
+    pthread_t thread;
+    atomic_int running;
+    atomic_int reset_requested;
+
+    uint8_t queue[DISPLAY_QUEUE_SIZE];
+    atomic_uint_fast64_t head;
+    atomic_uint_fast64_t tail;
+
+    // owned by the display thread
+    uint32_t canvas[DISPLAY_MAX_WIDTH * DISPLAY_MAX_HEIGHT];
+    const struct screen_geometry *geometry;
+    struct display_rect dirty[DISPLAY_MAX_DIRTY_RECTS];
+    uint32_t dirty_count;
+    struct display_rect previous_dirty[DISPLAY_MAX_DIRTY_RECTS];
+    uint32_t previous_dirty_count;
+    uint64_t frame_number;
+    uint64_t timestamp_ns;
+    struct color rectangle_color;
+    uint32_t background;
+    uint16_t waveform_size;
+} display;
+
+static uint32_t pixel(const struct color color) {
+    return (uint32_t) color.r << 16 | (uint32_t) color.g << 8 | color.b;
+}
+
+/**
+ * Adds a region to the list of changed regions of the next frame. Extends the last region
+ * when the new one continues it on the same row, e.g. consecutive characters.
+ */
+static void mark_dirty(const struct display_rect rect) {
+    if (display.dirty_count > 0) {
+        struct display_rect *last = &display.dirty[display.dirty_count - 1];
+        if (last->y == rect.y && last->height == rect.height && last->x + last->width == rect.x) {
+            last->width += rect.width;
+            return;
+        }
+    }
+    if (display.dirty_count < DISPLAY_MAX_DIRTY_RECTS) {
+        display.dirty[display.dirty_count++] = rect;
+        return;
+    }
+
+    // out of slots, grow the last region to cover the new one
+    struct display_rect *last = &display.dirty[DISPLAY_MAX_DIRTY_RECTS - 1];
+    const uint16_t x2 = last->x + last->width > rect.x + rect.width ? last->x + last->width : rect.x + rect.width;
+    const uint16_t y2 = last->y + last->height > rect.y + rect.height ? last->y + last->height : rect.y + rect.height;
+    last->x = last->x < rect.x ? last->x : rect.x;
+    last->y = last->y < rect.y ? last->y : rect.y;
+    last->width = x2 - last->x;
+    last->height = y2 - last->y;
+}
+
+/**
+ * Clips a rectangle to the screen.
+ *
+ * @return Returns 1 if anything is left of the rectangle, otherwise returns 0.
+ */
+static int clip(struct display_rect *rect) {
+    if (rect->x >= display.geometry->width || rect->y >= display.geometry->height)
+        return 0;
+    if (rect->x + rect->width > display.geometry->width)
+        rect->width = display.geometry->width - rect->x;
+    if (rect->y + rect->height > display.geometry->height)
+        rect->height = display.geometry->height - rect->y;
+    return rect->width > 0 && rect->height > 0;
+}
+
+static void fill_rect(struct display_rect rect, const uint32_t color) {
+    if (!clip(&rect))
+        return;
+
+    for (uint32_t y = rect.y; y < (uint32_t) rect.y + rect.height; y++) {
+        uint32_t *row = &display.canvas[y * DISPLAY_MAX_WIDTH];
+        for (uint32_t x = rect.x; x < (uint32_t) rect.x + rect.width; x++)
+            row[x] = color;
+    }
+    mark_dirty(rect);
+}
+
+static void set_geometry(const struct screen_geometry *geometry) {
+    if (display.geometry == geometry)
+        return;
+
+    display.geometry = geometry;
+    display.shm->width = geometry->width;
+    display.shm->height = geometry->height;
+    memset(display.canvas, 0, sizeof(display.canvas));
+    display.dirty_count = 0;
+    mark_dirty((struct display_rect){0, 0, DISPLAY_MAX_WIDTH, DISPLAY_MAX_HEIGHT});
+}
+
+static void draw_rectangle(const uint8_t *data, const uint32_t size) {
+    struct display_rect rect = {screen_read_u16(data, 1), screen_read_u16(data, 3), 1, 1};
+
+    // shorter packets leave out the size and/or the colour
+    if (size == 9 || size == 12) {
+        rect.width = screen_read_u16(data, 5);
+        rect.height = screen_read_u16(data, 7);
+    }
+    if (size == 8)
+        display.rectangle_color = (struct color){data[5], data[6], data[7]};
+    else if (size == 12)
+        display.rectangle_color = (struct color){data[9], data[10], data[11]};
+
+    const uint32_t color = pixel(display.rectangle_color);
+
+    // a full screen rectangle clears the screen and sets the background colour
+    if (rect.x == 0 && rect.y == 0 && rect.width >= display.geometry->width &&
+        rect.height >= display.geometry->height)
+        display.background = color;
+
+    fill_rect(rect, color);
+}
+
+static void draw_character(const uint8_t *data) {
+    const uint8_t c = data[1];
+    const uint16_t x = screen_read_u16(data, 2);
+    const uint16_t y = screen_read_u16(data, 4);
+    const uint32_t foreground = pixel((struct color){data[6], data[7], data[8]});
+    const uint32_t background = pixel((struct color){data[9], data[10], data[11]});
+    const struct screen_geometry *geometry = display.geometry;
+
+    struct display_rect cell = {x, y, geometry->cell_width, geometry->cell_height};
+    if (!clip(&cell))
+        return;
+
+    // the background is transparent when it has the same colour as the text
+    if (foreground != background)
+        fill_rect(cell, background);
+    else
+        mark_dirty(cell);
+
+    if (c < FONT_FIRST_CHAR || c > FONT_LAST_CHAR)
+        return;
+
+    const uint8_t *glyph = font_glyphs[c - FONT_FIRST_CHAR];
+    const uint32_t left = x + (geometry->cell_width - FONT_GLYPH_WIDTH) / 2;
+    const uint32_t top = y + (geometry->cell_height - FONT_GLYPH_HEIGHT) / 2;
+    for (uint32_t column = 0; column < FONT_GLYPH_WIDTH; column++) {
+        for (uint32_t row = 0; row < FONT_GLYPH_HEIGHT; row++) {
+            if (glyph[column] & 1 << row && left + column < (uint32_t) cell.x + cell.width &&
+                top + row < (uint32_t) cell.y + cell.height)
+                display.canvas[(top + row) * DISPLAY_MAX_WIDTH + left + column] = foreground;
+        }
+    }
+}
+
+static void draw_waveform(const uint8_t *data, const uint32_t size) {
+    const uint32_t color = pixel((struct color){data[1], data[2], data[3]});
+    const uint16_t waveform_size = size - 4;
+    const uint8_t height = display.geometry->waveform_height;
+
+    // an empty waveform clears the previous one
+    if (waveform_size == 0 && display.waveform_size == 0)
+        return;
+
+    const uint16_t cleared_size = waveform_size > 0 ? waveform_size : display.waveform_size;
+    const uint16_t left = display.geometry->width > cleared_size ? display.geometry->width - cleared_size : 0;
+    fill_rect((struct display_rect){left, 0, cleared_size, height + 1}, display.background);
+
+    const uint16_t start = display.geometry->width > waveform_size ? display.geometry->width - waveform_size : 0;
+    for (uint16_t i = 0; i < waveform_size && start + i < display.geometry->width; i++) {
+        const uint8_t y = data[4 + i] > height ? height : data[4 + i];
+        display.canvas[y * DISPLAY_MAX_WIDTH + start + i] = color;
+    }
+    display.waveform_size = waveform_size;
+}
+
+/**
+ * Copies a region of the canvas into a frame in shared memory.
+ */
+static void copy_region(struct display_frame *frame, const struct display_rect rect) {
+    for (uint32_t y = rect.y; y < (uint32_t) rect.y + rect.height; y++)
+        memcpy(&frame->pixels[y * DISPLAY_MAX_WIDTH + rect.x], &display.canvas[y * DISPLAY_MAX_WIDTH + rect.x],
+               rect.width * sizeof(uint32_t));
+}
+
+/**
+ * Publishes the canvas in the frame that is not being shown. That frame still holds the canvas
+ * as it was two frames ago, so the changes of the previous frame are copied into it as well.
+ */
+static void publish_frame() {
+    const uint32_t back = display.shm->front ^ 1;
+    struct display_frame *frame = &display.shm->frames[back];
+
+    const uint64_t sequence = frame->sequence;
+    __atomic_store_n(&frame->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    for (uint32_t i = 0; i < display.previous_dirty_count; i++)
+        copy_region(frame, display.previous_dirty[i]);
+    for (uint32_t i = 0; i < display.dirty_count; i++)
+        copy_region(frame, display.dirty[i]);
+
+    memcpy(frame->dirty, display.dirty, display.dirty_count * sizeof(struct display_rect));
+    frame->dirty_count = display.dirty_count;
+    frame->frame_number = ++display.frame_number;
+    frame->timestamp_ns = display.timestamp_ns;
+
+    __atomic_store_n(&frame->sequence, sequence + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&display.shm->front, back, __ATOMIC_RELEASE);
+
+    memcpy(display.previous_dirty, display.dirty, sizeof(display.dirty));
+    display.previous_dirty_count = display.dirty_count;
+    display.dirty_count = 0;
+}
+
+static void read_queue(const uint64_t position, void *dest, const size_t size) {
+    const size_t offset = position & (DISPLAY_QUEUE_SIZE - 1);
+    const size_t first = size < DISPLAY_QUEUE_SIZE - offset ? size : DISPLAY_QUEUE_SIZE - offset;
+    memcpy(dest, &display.queue[offset], first);
+    memcpy((uint8_t *) dest + first, display.queue, size - first);
+}
+
+static void write_queue(const uint64_t position, const void *src, const size_t size) {
+    const size_t offset = position & (DISPLAY_QUEUE_SIZE - 1);
+    const size_t first = size < DISPLAY_QUEUE_SIZE - offset ? size : DISPLAY_QUEUE_SIZE - offset;
+    memcpy(&display.queue[offset], src, first);
+    memcpy(display.queue, (const uint8_t *) src + first, size - first);
+}
+
+/**
+ * Rasterises all queued packets into the canvas.
+ */
+static void drain_queue() {
+    const uint64_t head = atomic_load_explicit(&display.head, memory_order_acquire);
+    uint64_t tail = atomic_load_explicit(&display.tail, memory_order_relaxed);
+    uint8_t data[DISPLAY_MAX_PACKET_SIZE];
+
+    while (tail != head) {
+        struct queued_packet packet;
+        read_queue(tail, &packet, sizeof(packet));
+        read_queue(tail + sizeof(packet), data, packet.size);
+        tail += sizeof(packet) + packet.size;
+
+        switch (data[0]) {
+            case 0xFE:
+                draw_rectangle(data, packet.size);
+                break;
+            case 0xFD:
+                draw_character(data);
+                break;
+            case 0xFC:
+                draw_waveform(data, packet.size);
+                break;
+            case 0xFF:
+                set_geometry(screen_geometry(data[1]));
+                break;
+            default:
+                break;
+        }
+        display.timestamp_ns = packet.timestamp_ns;
+    }
+    atomic_store_explicit(&display.tail, tail, memory_order_release);
+}
+
+static void *display_thread(void *arg) {
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+
+    while (atomic_load(&display.running)) {
+        next.tv_nsec += DISPLAY_FRAME_INTERVAL_NS;
+        if (next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+
+        drain_queue();
+        if (display.dirty_count > 0)
+            publish_frame();
+    }
+    return NULL;
+}
+
+/**
+ * Creates the shared memory segment for the display mirror and starts the display thread.
+ *
+ * @param name Name of the POSIX shared memory segment, e.g. DISPLAY_SHM_NAME.
+ * @return Returns 1 on success, 0 otherwise.
+ */
+int display_open(const char *name) {
+    int fd;
+    void *map = shm_create_segment(name, sizeof(struct display_header), "display", &fd);
+    if (map == NULL)
+        return 0;
+
+    display.shm = map;
+    display.fd = fd;
+    demand_watch(fd);
+    snprintf(display.name, sizeof(display.name), "%s", name);
+    memset(display.shm, 0, sizeof(struct display_header));
+    display.shm->version = DISPLAY_VERSION;
+    set_geometry(screen_geometry(0));
+    __atomic_store_n(&display.shm->magic, DISPLAY_MAGIC, __ATOMIC_RELEASE);
+    footprint_prefault(display.queue, sizeof(display.queue));
+
+    atomic_store(&display.running, 1);
+    if (pthread_create(&display.thread, NULL, display_thread, NULL) != 0) {
+        fprintf(stderr, "Cannot start display thread\n");
+        atomic_store(&display.running, 0);
+        display_close();
+        return 0;
+    }
+
+    fprintf(stderr, "Mirroring the display to shared memory %s\n", name);
+    return 1;
+}
+
+/**
+ * Queues a draw or system info packet for the display thread. Called from the serial thread;
+ * only copies the packet. If the queue is full the packet is dropped and a display reset is
+ * requested to get a complete redraw.
+ *
+ * @param data The packet.
+ * @param size Size of the packet.
+ * @param timestamp_ns Arrival time of the packet.
+ */
+void display_queue_packet(const uint8_t *data, const uint32_t size, const uint64_t timestamp_ns) {
+    if (display.shm == NULL || size > DISPLAY_MAX_PACKET_SIZE)
+        return;
+
+    const struct queued_packet packet = {.timestamp_ns = timestamp_ns, .size = size};
+    const uint64_t head = atomic_load_explicit(&display.head, memory_order_relaxed);
+    const uint64_t tail = atomic_load_explicit(&display.tail, memory_order_acquire);
+
+    if (DISPLAY_QUEUE_SIZE - (head - tail) < sizeof(packet) + size) {
+        atomic_store_explicit(&display.reset_requested, 1, memory_order_relaxed);
+        return;
+    }
+
+    write_queue(head, &packet, sizeof(packet));
+    write_queue(head + sizeof(packet), data, size);
+    atomic_store_explicit(&display.head, head + sizeof(packet) + size, memory_order_release);
+}
+
+/**
+ * Checks whether draw packets were lost and the M8 display should be reset to redraw everything.
+ *
+ * @return Returns 1 once after packets were dropped, otherwise returns 0.
+ */
+int display_take_reset_request() {
+    return atomic_exchange_explicit(&display.reset_requested, 0, memory_order_relaxed);
+}
+
+void display_close() {
+    if (display.shm == NULL)
+        return;
+
+    if (atomic_load(&display.running)) {
+        atomic_store(&display.running, 0);
+        pthread_join(display.thread, NULL);
+    }
+    munmap(display.shm, sizeof(struct display_header));
+    close(display.fd);
+    shm_unlink(display.name);
+    display.shm = NULL;
+}
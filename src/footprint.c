@@ -0,0 +1,193 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+// Memory footprint of the main loop: peak resident set size and page faults,
+// and with M8JS_FIXED_FOOTPRINT the number of heap allocations. That build
+// profile is meant for small boards where resident memory and page faults
+// matter: buffers are static and touched before the main loop starts, and
+// the main loop is expected not to allocate at all.
+
+#include "footprint.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+static struct {
+    int started;
+    int stopped;
+    long minor_faults;
+    long major_faults;
+    uint64_t allocations;
+} footprint;
+
+#if defined(M8JS_FIXED_FOOTPRINT) && defined(__GLIBC__)
+
+#define FOOTPRINT_COUNTS_ALLOCATIONS 1
+
+// The allocator is wrapped to count calls from all threads and libraries, glibc's own does the work.
+// Every allocating entry point is covered, so that none of them bypasses the count.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void *__libc_valloc(size_t size);
+extern void *__libc_pvalloc(size_t size);
+
+static atomic_uint_fast64_t allocations;
+
+static void count_allocation() {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+}
+
+void *malloc(const size_t size) {
+    count_allocation();
+    return __libc_malloc(size);
+}
+
+void *calloc(const size_t count, const size_t size) {
+    count_allocation();
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, const size_t size) {
+    count_allocation();
+    return __libc_realloc(ptr, size);
+}
+
+void *reallocarray(void *ptr, const size_t count, const size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    count_allocation();
+    return __libc_realloc(ptr, total);
+}
+
+void *memalign(const size_t alignment, const size_t size) {
+    count_allocation();
+    return __libc_memalign(alignment, size);
+}
+
+void *aligned_alloc(const size_t alignment, const size_t size) {
+    count_allocation();
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, const size_t alignment, const size_t size) {
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0)
+        return EINVAL;
+    count_allocation();
+    void *p = __libc_memalign(alignment, size);
+    if (p == NULL)
+        return ENOMEM;
+    *ptr = p;
+    return 0;
+}
+
+void *valloc(const size_t size) {
+    count_allocation();
+    return __libc_valloc(size);
+}
+
+void *pvalloc(const size_t size) {
+    count_allocation();
+    return __libc_pvalloc(size);
+}
+
+#else
+
+#define FOOTPRINT_COUNTS_ALLOCATIONS 0
+
+#endif
+
+/**
+ * Prepares the process for a fixed footprint. Called first thing in main(), before anything is
+ * written to stdout.
+ */
+void footprint_init() {
+#ifdef M8JS_FIXED_FOOTPRINT
+    // stdio would allocate the buffer on the first write, which may be an error message in the main loop
+    static char stdout_buffer[BUFSIZ];
+    setvbuf(stdout, stdout_buffer, _IOLBF, sizeof(stdout_buffer));
+#endif
+}
+
+/**
+ * Touches every page of a buffer so that it is resident before the main loop starts. Only done
+ * in M8JS_FIXED_FOOTPRINT builds.
+ *
+ * @param buf The buffer.
+ * @param size Size of the buffer in bytes.
+ */
+void footprint_prefault(void *buf, const size_t size) {
+#ifdef M8JS_FIXED_FOOTPRINT
+    const size_t page_size = sysconf(_SC_PAGESIZE);
+    volatile uint8_t *bytes = buf;
+    for (size_t i = 0; i < size; i += page_size)
+        bytes[i] = bytes[i];
+    if (size > 0)
+        bytes[size - 1] = bytes[size - 1];
+#else
+    (void) buf;
+    (void) size;
+#endif
+}
+
+/**
+ * Counts the page faults and allocations so far: the baseline at the start of the main loop,
+ * the difference to it at the end.
+ */
+static void count(const int sign) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    footprint.minor_faults += sign * usage.ru_minflt;
+    footprint.major_faults += sign * usage.ru_majflt;
+#if FOOTPRINT_COUNTS_ALLOCATIONS
+    footprint.allocations += sign * atomic_load(&allocations);
+#endif
+}
+
+/**
+ * Marks the start of the main loop, allocations and page faults are counted from here on.
+ */
+void footprint_start() {
+    count(-1);
+    footprint.started = 1;
+}
+
+/**
+ * Marks the end of the main loop.
+ */
+void footprint_stop() {
+    if (!footprint.started || footprint.stopped)
+        return;
+    count(1);
+    footprint.stopped = 1;
+}
+
+/**
+ * Prints the peak resident set size and what happened in the main loop.
+ *
+ * @param out The stream to print to.
+ * @return Returns 0 if an M8JS_FIXED_FOOTPRINT build allocated memory in the main loop, otherwise 1.
+ */
+int footprint_report(FILE *out) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    fprintf(out, "Peak resident set size %ld KiB\n", usage.ru_maxrss);
+    if (!footprint.stopped)
+        return 1;
+    fprintf(out, "Main loop page faults: minor %ld, major %ld\n", footprint.minor_faults, footprint.major_faults);
+#if FOOTPRINT_COUNTS_ALLOCATIONS
+    fprintf(out, "Main loop heap allocations: %llu\n", (unsigned long long) footprint.allocations);
+    if (footprint.allocations > 0) {
+        fprintf(stderr, "The main loop allocated memory in a fixed footprint build\n");
+        return 0;
+    }
+#endif
+    return 1;
+}
@@ -0,0 +1,19 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+#ifndef AUTOFIRE_H_
+#define AUTOFIRE_H_
+
+#include <stdint.h>
+
+int autofire_add_turbo(const char *spec);
+int autofire_add_autorepeat(const char *spec);
+int autofire_add_macro(const char *spec);
+int autofire_init();
+int autofire_enabled();
+int autofire_get_fd();
+int autofire_on_key_state(uint8_t keys, uint64_t timestamp_ns);
+void autofire_poll();
+void autofire_report();
+void autofire_destroy();
+
+#endif
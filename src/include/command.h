@@ -41,6 +41,6 @@ struct draw_oscilloscope_waveform_command {
   uint16_t waveform_size;
 };
 
-int process_command(uint8_t *data, uint32_t size);
+int process_command(uint8_t *data, uint32_t size, uint64_t timestamp_ns);
 
 #endif
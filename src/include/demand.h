@@ -0,0 +1,18 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+#ifndef DEMAND_H_
+#define DEMAND_H_
+
+// Screen data is only produced while something reads it. A consumer holds a shared
+// flock() on each segment it reads for as long as it reads it. m8js checks for such
+// locks every DEMAND_POLL_INTERVAL_MS and asks the M8 for a full redraw when the first
+// one appears, so a consumer should wait up to DEMAND_ATTACH_WAIT_MS after taking
+// the lock before it trusts what it reads.
+#define DEMAND_POLL_INTERVAL_MS 250
+#define DEMAND_ATTACH_WAIT_MS 1000
+
+void demand_watch(int fd);
+int demand_consumers_attached();
+void demand_poll();
+
+#endif
@@ -0,0 +1,106 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+#ifndef DISPLAY_H_
+#define DISPLAY_H_
+
+#include <stdint.h>
+#include <string.h>
+
+// Layout of the display mirror in shared memory. Consumers map the segment
+// read-only and use display_copy_changes() to keep a local copy up to date.
+// Consumers announce themselves as described in demand.h.
+
+#define DISPLAY_SHM_NAME "/m8js-display"
+#define DISPLAY_MAGIC 0x5053444A534A384Dull // "M8JSJDSP"
+#define DISPLAY_VERSION 1
+#define DISPLAY_MAX_WIDTH 480
+#define DISPLAY_MAX_HEIGHT 320
+#define DISPLAY_MAX_DIRTY_RECTS 64
+// times display_copy_changes() tries to read a frame before it gives up
+#define DISPLAY_COPY_ATTEMPTS 4096
+
+struct display_rect {
+    uint16_t x;
+    uint16_t y;
+    uint16_t width;
+    uint16_t height;
+};
+
+struct display_frame {
+    // odd while m8js is updating the frame
+    uint64_t sequence;
+    uint64_t frame_number;
+    // arrival time of the last draw command in the frame, CLOCK_MONOTONIC nanoseconds
+    uint64_t timestamp_ns;
+    // regions that differ from the previous frame
+    uint32_t dirty_count;
+    uint32_t reserved;
+    struct display_rect dirty[DISPLAY_MAX_DIRTY_RECTS];
+    // XRGB8888 pixels, DISPLAY_MAX_WIDTH pixels per row
+    uint32_t pixels[DISPLAY_MAX_WIDTH * DISPLAY_MAX_HEIGHT];
+};
+
+struct display_header {
+    uint64_t magic;
+    uint32_t version;
+    uint16_t width;
+    uint16_t height;
+    // index of the latest complete frame
+    uint32_t front;
+    uint32_t reserved;
+    struct display_frame frames[2];
+};
+
+/**
+ * Brings a local copy of the screen up to date. Only the changed regions are copied when the
+ * local copy is one frame behind, otherwise the whole screen is copied.
+ *
+ * @param header The mapped display segment.
+ * @param pixels Local XRGB8888 copy of the screen, DISPLAY_MAX_WIDTH pixels per row.
+ * @param frame_number Number of the frame in the local copy, updated on return. Start with 0.
+ * @return Returns 1 if the local copy changed, 0 if it was already up to date, -1 if no complete
+ *         frame could be read in DISPLAY_COPY_ATTEMPTS tries. The latter happens while m8js is busy
+ *         writing frames, or for good if it died while writing one; the local copy is then not valid
+ *         until a later call returns 1.
+ */
+static inline int display_copy_changes(const struct display_header *header, uint32_t *pixels,
+                                       uint64_t *frame_number) {
+    for (int attempt = 0; attempt < DISPLAY_COPY_ATTEMPTS; attempt++) {
+        const struct display_frame *frame =
+            &header->frames[__atomic_load_n(&header->front, __ATOMIC_ACQUIRE) & 1];
+        const uint64_t sequence = __atomic_load_n(&frame->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1)
+            continue;
+
+        const uint64_t number = frame->frame_number;
+        if (number == *frame_number)
+            return 0;
+
+        if (number == *frame_number + 1 && frame->dirty_count <= DISPLAY_MAX_DIRTY_RECTS) {
+            for (uint32_t i = 0; i < frame->dirty_count; i++) {
+                const struct display_rect r = frame->dirty[i];
+                for (uint32_t y = r.y; y < (uint32_t) r.y + r.height; y++)
+                    memcpy(&pixels[y * DISPLAY_MAX_WIDTH + r.x], &frame->pixels[y * DISPLAY_MAX_WIDTH + r.x],
+                           r.width * sizeof(uint32_t));
+            }
+        } else {
+            memcpy(pixels, frame->pixels, sizeof(frame->pixels));
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&frame->sequence, __ATOMIC_RELAXED) == sequence) {
+            *frame_number = number;
+            return 1;
+        }
+        // the frame was rewritten while copying, start over with a full copy
+        *frame_number = 0;
+    }
+    return -1;
+}
+
+int display_open(const char *name);
+void display_queue_packet(const uint8_t *data, uint32_t size, uint64_t timestamp_ns);
+int display_take_reset_request();
+void display_close();
+
+#endif
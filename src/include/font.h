@@ -0,0 +1,16 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+#ifndef FONT_H_
+#define FONT_H_
+
+#include <stdint.h>
+
+#define FONT_FIRST_CHAR 0x20
+#define FONT_LAST_CHAR 0x7E
+#define FONT_GLYPH_WIDTH 5
+#define FONT_GLYPH_HEIGHT 7
+
+// 5x7 glyphs for printable ASCII, one byte per column with the top row in the lowest bit
+extern const uint8_t font_glyphs[FONT_LAST_CHAR - FONT_FIRST_CHAR + 1][FONT_GLYPH_WIDTH];
+
+#endif
@@ -0,0 +1,21 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+#ifndef FOOTPRINT_H_
+#define FOOTPRINT_H_
+
+#include <stddef.h>
+#include <stdio.h>
+
+#ifdef M8JS_FIXED_FOOTPRINT
+#define FOOTPRINT_FIXED 1
+#else
+#define FOOTPRINT_FIXED 0
+#endif
+
+void footprint_init();
+void footprint_prefault(void *buf, size_t size);
+void footprint_start();
+void footprint_stop();
+int footprint_report(FILE *out);
+
+#endif
@@ -0,0 +1,53 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+#include <stdint.h>
+
+// Layout of the key transition journal file, shared with tools/m8js-journal.c.
+// The file is a header followed by a circular array of records.
+
+#define JOURNAL_MAGIC 0x4C4E524A534A384Dull // "M8JSJRNL"
+#define JOURNAL_VERSION 1
+#define JOURNAL_RECORDS 65536
+#define JOURNAL_DEVICES 8
+#define JOURNAL_DEVICE_NAME_SIZE 64
+
+enum journal_flags {
+    JOURNAL_SLIP_OVERFLOW = 1 << 0,
+    JOURNAL_SLIP_BAD_ESCAPE = 1 << 1,
+    JOURNAL_INVALID_PACKET = 1 << 2,
+    JOURNAL_UINPUT_FAILED = 1 << 3,
+};
+
+struct journal_record {
+    // 1-based sequence number, written last. 0 marks an unused or partly written record.
+    uint64_t sequence;
+    // CLOCK_REALTIME nanoseconds of the packet's arrival
+    uint64_t timestamp_ns;
+    // index into journal_header.devices
+    uint16_t device;
+    uint8_t old_keys;
+    uint8_t new_keys;
+    // errors seen since the previous record
+    uint8_t flags;
+    uint8_t reserved[3];
+};
+
+struct journal_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t capacity;
+    uint32_t device_count;
+    uint64_t next_sequence;
+    char devices[JOURNAL_DEVICES][JOURNAL_DEVICE_NAME_SIZE];
+};
+
+int journal_open(const char *path, const char *device);
+void journal_note_errors(uint8_t flags);
+void journal_key_state(uint8_t keys, uint64_t timestamp_ns, uint8_t flags);
+void journal_close();
+
+#endif
@@ -0,0 +1,50 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+enum metrics_frame_type {
+    METRICS_FRAME_JOYPAD,
+    METRICS_FRAME_SYSTEM_INFO,
+    METRICS_FRAME_CHARACTER,
+    METRICS_FRAME_OSCILLOSCOPE,
+    METRICS_FRAME_RECTANGLE,
+    METRICS_FRAME_UNKNOWN,
+    METRICS_FRAME_TYPES
+};
+
+// Counters and gauges for the connected device. Updated from the I/O loop with
+// relaxed atomics and read by the metrics thread.
+typedef struct {
+    atomic_uint_fast64_t serial_bytes;
+    atomic_uint_fast64_t frames[METRICS_FRAME_TYPES];
+    atomic_uint_fast64_t frame_bytes[METRICS_FRAME_TYPES];
+    atomic_uint_fast64_t slip_overflows;
+    atomic_uint_fast64_t slip_bad_escapes;
+    atomic_uint_fast64_t invalid_packets;
+    atomic_uint_fast64_t display_resets;
+    atomic_uint_fast64_t display_resets_skipped;
+    atomic_uint_fast64_t uinput_writes;
+    atomic_uint_fast64_t uinput_write_failures;
+    atomic_uint_fast64_t synthetic_key_states;
+    atomic_uint_fast64_t autofire_wakeups;
+    atomic_uint_fast64_t autofire_lateness_ns;
+    atomic_uint_fast64_t disconnects;
+    atomic_uint_fast64_t connected;
+    atomic_uint_fast64_t joypad_state;
+    atomic_uint_fast64_t display_consumers;
+} metrics_s;
+
+extern metrics_s metrics;
+
+#define metrics_add(name, value) atomic_fetch_add_explicit(&metrics.name, (value), memory_order_relaxed)
+#define metrics_inc(name) metrics_add(name, 1)
+#define metrics_set(name, value) atomic_store_explicit(&metrics.name, (value), memory_order_relaxed)
+
+int metrics_start(const char *socket_path, const char *file_path, const char *device);
+void metrics_stop();
+
+#endif
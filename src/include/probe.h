@@ -0,0 +1,15 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+#ifndef PROBE_H_
+#define PROBE_H_
+
+#include <stdint.h>
+
+int probe_init(uint32_t samples, uint32_t interval_ms, uint8_t keys);
+int probe_is_running();
+int probe_poll();
+void probe_on_joypad_state(uint8_t keys, uint64_t timestamp_ns);
+void probe_report();
+void probe_destroy();
+
+#endif
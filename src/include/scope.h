@@ -0,0 +1,76 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+#ifndef SCOPE_H_
+#define SCOPE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Layout of the oscilloscope tap in shared memory: a ring of waveform frames
+// written by m8js and read in place by any number of consumers. Consumers
+// announce themselves as described in demand.h; without one m8js skips the
+// waveforms.
+
+#define SCOPE_SHM_NAME "/m8js-scope"
+#define SCOPE_MAGIC 0x45504F43534A384Dull // "M8JSCOPE"
+#define SCOPE_VERSION 1
+// must be a power of two
+#define SCOPE_SLOTS 64
+#define SCOPE_MAX_SAMPLES 480
+
+struct scope_frame {
+    // odd while m8js is writing the frame
+    uint64_t sequence;
+    uint64_t frame_number;
+    // arrival time of the waveform packet, CLOCK_MONOTONIC nanoseconds
+    uint64_t timestamp_ns;
+    uint32_t sample_count;
+    uint8_t color[3];
+    uint8_t reserved;
+    // samples scaled to -1.0 ... 1.0 and -32767 ... 32767, positive is up on the screen
+    float samples[SCOPE_MAX_SAMPLES];
+    int16_t samples_s16[SCOPE_MAX_SAMPLES];
+};
+
+struct scope_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t slots;
+    // number of frames written so far; the latest one is frame_count - 1
+    uint64_t frame_count;
+    struct scope_frame frames[SCOPE_SLOTS];
+};
+
+/**
+ * Starts reading a frame in place.
+ *
+ * @param header The mapped oscilloscope tap.
+ * @param frame_number The frame to read, e.g. frame_count - 1 for the latest one.
+ * @param sequence Set to the value to pass to scope_frame_end().
+ * @return The frame, or NULL if it is being written or has already been overwritten.
+ */
+static inline const struct scope_frame *scope_frame_begin(const struct scope_header *header,
+                                                          const uint64_t frame_number, uint64_t *sequence) {
+    const struct scope_frame *frame = &header->frames[frame_number & (SCOPE_SLOTS - 1)];
+    *sequence = __atomic_load_n(&frame->sequence, __ATOMIC_ACQUIRE);
+    if (*sequence & 1 || frame->frame_number != frame_number)
+        return NULL;
+    return frame;
+}
+
+/**
+ * Checks that a frame was not overwritten while it was read.
+ *
+ * @return Returns 1 if the data read since scope_frame_begin() is valid, otherwise returns 0.
+ */
+static inline int scope_frame_end(const struct scope_frame *frame, const uint64_t sequence) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&frame->sequence, __ATOMIC_RELAXED) == sequence;
+}
+
+int scope_open(const char *name);
+void scope_set_hardware(uint8_t hardware_type);
+void scope_push(const uint8_t *data, uint32_t size, uint64_t timestamp_ns);
+void scope_close();
+
+#endif
@@ -0,0 +1,40 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+#ifndef SCREEN_H_
+#define SCREEN_H_
+
+#include <stdint.h>
+
+// Screen layout of the different M8 hardware types, see the system info packet
+struct screen_geometry {
+    uint16_t width;
+    uint16_t height;
+    // size of a character cell in the text grid
+    uint8_t cell_width;
+    uint8_t cell_height;
+    // height of the oscilloscope area in the top right corner
+    uint8_t waveform_height;
+};
+
+/**
+ * Returns the screen layout for a hardware type reported in the system info packet.
+ *
+ * @param hardware_type 0 headless, 1 beta M8, 2 production M8, 3 production M8 model:02.
+ */
+static inline const struct screen_geometry *screen_geometry(const uint8_t hardware_type) {
+    static const struct screen_geometry model_01 = {320, 240, 8, 10, 20};
+    static const struct screen_geometry model_02 = {480, 320, 12, 14, 24};
+    return hardware_type == 3 ? &model_02 : &model_01;
+}
+
+/**
+ * Decodes a little endian 16 bit value from a packet.
+ *
+ * @param data The packet.
+ * @param start Offset of the value's low byte.
+ */
+static inline uint16_t screen_read_u16(const uint8_t *data, const int start) {
+    return data[start] | (uint16_t) data[start + 1] << 8;
+}
+
+#endif
@@ -8,14 +8,40 @@
 // maximum amount of bytes to read from the serial in one read()
 #define serial_read_size 1024
 
+#define serial_baud_rate 115200
+// time it takes to transfer one byte with 8N1 framing
+#define serial_byte_time_ns (10 * 1000000000ull / serial_baud_rate)
+
 int initialize_serial(int verbose, const char *preferred_device);
 int list_devices();
 int check_serial_port();
 int reset_display();
+int enable_display();
 int enable_and_reset_display();
 int disconnect();
-int serial_read(uint8_t *serial_buf, int count);
+int serial_read(uint8_t *serial_buf, int count, uint64_t *arrival_ns, uint64_t *earliest_ns);
+int serial_get_fd();
+const char *serial_port_name();
 int send_msg_controller(uint8_t input);
 int send_msg_keyjazz(uint8_t note, uint8_t velocity);
 
+/**
+ * Estimates the arrival time of a byte from the time its chunk was read, assuming the
+ * last byte of the chunk arrived at read time and the earlier ones at the line rate.
+ * Over USB a whole chunk can arrive at once, so no byte is dated before the previous read.
+ *
+ * @param chunk_arrival_ns Arrival time of the chunk as returned by serial_read().
+ * @param earliest_ns Time of the previous read as returned by serial_read().
+ * @param chunk_size Number of bytes in the chunk.
+ * @param index Position of the byte within the chunk.
+ * @return The estimated arrival time in CLOCK_MONOTONIC nanoseconds.
+ */
+static inline uint64_t serial_byte_arrival_ns(const uint64_t chunk_arrival_ns, const uint64_t earliest_ns,
+                                              const int chunk_size, const int index) {
+    const uint64_t line_time_ns = (uint64_t) (chunk_size - 1 - index) * serial_byte_time_ns;
+    if (chunk_arrival_ns - earliest_ns < line_time_ns)
+        return earliest_ns;
+    return chunk_arrival_ns - line_time_ns;
+}
+
 #endif
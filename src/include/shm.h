@@ -0,0 +1,10 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+#ifndef SHM_H_
+#define SHM_H_
+
+#include <stddef.h>
+
+void *shm_create_segment(const char *name, size_t size, const char *what, int *fd);
+
+#endif
@@ -45,7 +45,7 @@ typedef enum {
 typedef struct {
         uint8_t *buf;
         uint32_t buf_size;
-        int (*recv_message)(uint8_t *data, uint32_t size);
+        int (*recv_message)(uint8_t *data, uint32_t size, uint64_t timestamp_ns);
 } slip_descriptor_s;
 
 typedef struct {
@@ -62,6 +62,6 @@ typedef enum {
 } slip_error_t;
 
 slip_error_t slip_init(slip_handler_s *slip, const slip_descriptor_s *descriptor);
-slip_error_t slip_read_byte(slip_handler_s *slip, uint8_t byte);
+slip_error_t slip_read_byte(slip_handler_s *slip, uint8_t byte, uint64_t timestamp_ns);
 
 #endif
\ No newline at end of file
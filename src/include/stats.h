@@ -0,0 +1,30 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+#ifndef STATS_H_
+#define STATS_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef M8JS_FIXED_FOOTPRINT
+// A fixed footprint build keeps the samples of all statistics in one static pool of this many samples
+#define LATENCY_STATS_POOL_SAMPLES 8192
+#endif
+
+// Collects latency samples (in nanoseconds) and summarises their distribution
+typedef struct {
+    uint64_t *samples;
+    uint32_t capacity;
+    uint32_t count;
+    uint64_t last;
+    double sum;
+    double sum_sq;
+    double jitter_sum;
+} latency_stats_s;
+
+int latency_stats_init(latency_stats_s *stats, uint32_t capacity);
+void latency_stats_add(latency_stats_s *stats, uint64_t ns);
+void latency_stats_print(latency_stats_s *stats, const char *name, FILE *out);
+void latency_stats_free(latency_stats_s *stats);
+
+#endif
@@ -0,0 +1,136 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+#ifndef TEXTGRID_H_
+#define TEXTGRID_H_
+
+#include <linux/futex.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Layout of the text grid in shared memory. The grid holds the characters drawn
+// on the M8 screen with their colours, so consumers can follow what is on the
+// screen without looking at pixels. Consumers announce themselves as described
+// in demand.h.
+
+#define TEXTGRID_SHM_NAME "/m8js-textgrid"
+#define TEXTGRID_MAGIC 0x44495247534A384Dull // "M8JSGRID"
+#define TEXTGRID_VERSION 1
+#define TEXTGRID_MAX_COLUMNS 40
+#define TEXTGRID_MAX_ROWS 32
+// times textgrid_read_rows() tries to read the grid before it gives up
+#define TEXTGRID_READ_ATTEMPTS 4096
+
+struct textgrid_cell {
+    uint8_t c;
+    uint8_t foreground[3];
+    uint8_t background[3];
+    uint8_t reserved;
+};
+
+struct textgrid_header {
+    uint64_t magic;
+    uint32_t version;
+    uint16_t columns;
+    uint16_t rows;
+    // odd while cells are being updated
+    uint32_t sequence;
+    // incremented each time a batch of changes is published, can be waited on with textgrid_wait()
+    uint32_t generation;
+    // number of consumers waiting in textgrid_wait()
+    uint32_t waiters;
+    // bit per row changed in the latest generation
+    uint32_t dirty_rows;
+    // arrival time of the latest change, CLOCK_MONOTONIC nanoseconds
+    uint64_t timestamp_ns;
+    // generation in which each row last changed
+    uint32_t row_generation[TEXTGRID_MAX_ROWS];
+    struct textgrid_cell cells[TEXTGRID_MAX_ROWS][TEXTGRID_MAX_COLUMNS];
+};
+
+/**
+ * Returns the rows that changed after a given generation. Unlike dirty_rows this also covers
+ * generations the consumer missed.
+ *
+ * @param header The mapped text grid.
+ * @param generation The generation the consumer has seen, updated to the current one.
+ * @return A bitmap with a bit set for each changed row.
+ */
+static inline uint32_t textgrid_changed_rows(const struct textgrid_header *header, uint32_t *generation) {
+    const uint32_t current = __atomic_load_n(&header->generation, __ATOMIC_ACQUIRE);
+    uint32_t rows = 0;
+
+    for (uint32_t row = 0; row < TEXTGRID_MAX_ROWS; row++) {
+        if ((int32_t) (__atomic_load_n(&header->row_generation[row], __ATOMIC_RELAXED) - *generation) > 0)
+            rows |= 1u << row;
+    }
+    *generation = current;
+    return rows;
+}
+
+/**
+ * Copies the rows that changed after a given generation to a local copy of the grid. The copy is
+ * only taken if m8js did not update the grid while it was made.
+ *
+ * @param header The mapped text grid.
+ * @param cells Local copy of the cells.
+ * @param generation The generation in the local copy, updated on success. Start with 0.
+ * @param rows Receives a bitmap with a bit set for each copied row.
+ * @return Returns 1 if rows were copied, 0 if the local copy was already up to date, -1 if no
+ *         consistent copy could be made in TEXTGRID_READ_ATTEMPTS tries. The latter happens while
+ *         m8js is busy updating the grid, or for good if it died while updating it.
+ */
+static inline int textgrid_read_rows(const struct textgrid_header *header,
+                                     struct textgrid_cell cells[TEXTGRID_MAX_ROWS][TEXTGRID_MAX_COLUMNS],
+                                     uint32_t *generation, uint32_t *rows) {
+    for (int attempt = 0; attempt < TEXTGRID_READ_ATTEMPTS; attempt++) {
+        const uint32_t sequence = __atomic_load_n(&header->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1)
+            continue;
+
+        uint32_t current = *generation;
+        const uint32_t changed = textgrid_changed_rows(header, &current);
+        for (uint32_t row = 0; row < TEXTGRID_MAX_ROWS; row++) {
+            if (changed & 1u << row)
+                memcpy(cells[row], header->cells[row], sizeof(cells[row]));
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&header->sequence, __ATOMIC_RELAXED) == sequence) {
+            *generation = current;
+            *rows = changed;
+            return changed != 0;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Waits until the grid changes after a given generation.
+ *
+ * @param header The mapped text grid.
+ * @param generation The generation the consumer has seen.
+ * @param timeout_ms Maximum time to wait in milliseconds.
+ * @return Returns 1 if the grid has changed, 0 on timeout.
+ */
+static inline int textgrid_wait(struct textgrid_header *header, const uint32_t generation, const int timeout_ms) {
+    const struct timespec timeout = {timeout_ms / 1000, (long) (timeout_ms % 1000) * 1000000};
+
+    __atomic_fetch_add(&header->waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&header->generation, __ATOMIC_SEQ_CST) == generation)
+        syscall(SYS_futex, &header->generation, FUTEX_WAIT, generation, &timeout, NULL, 0);
+    __atomic_fetch_sub(&header->waiters, 1, __ATOMIC_SEQ_CST);
+
+    return __atomic_load_n(&header->generation, __ATOMIC_ACQUIRE) != generation;
+}
+
+int textgrid_open(const char *name);
+void textgrid_set_hardware(uint8_t hardware_type);
+void textgrid_draw_character(const uint8_t *data, uint64_t timestamp_ns);
+void textgrid_draw_rectangle(const uint8_t *data, uint32_t size);
+void textgrid_publish();
+void textgrid_close();
+
+#endif
@@ -0,0 +1,18 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+#ifndef TIMING_H_
+#define TIMING_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Returns the current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static inline uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+#endif
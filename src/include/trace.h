@@ -0,0 +1,45 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <stdio.h>
+
+// Stages of the read-decode-dispatch pipeline that can be traced
+enum trace_point {
+    TRACE_SERIAL_READ,
+    TRACE_SLIP_DECODE,
+    TRACE_PROCESS_COMMAND,
+    TRACE_UINPUT_WRITE,
+    TRACE_POINTS
+};
+
+#ifdef M8JS_TRACE
+
+#include <stdint.h>
+
+#include "timing.h"
+
+// Marks the start and end of a traced stage within one block
+#define trace_begin(point) const uint64_t trace_start_##point = monotonic_ns()
+#define trace_end(point) trace_record(point, trace_start_##point)
+
+void trace_record(enum trace_point point, uint64_t start_ns);
+int trace_open(const char *path);
+void trace_close();
+
+#else
+
+#define trace_begin(point)
+#define trace_end(point)
+
+static inline int trace_open(const char *path) {
+    fprintf(stderr, "Cannot trace to %s, m8js was built without M8JS_TRACE\n", path);
+    return 0;
+}
+
+static inline void trace_close() {}
+
+#endif
+
+#endif
@@ -8,6 +8,6 @@
 
 int initialize_virtual_joystick();
 int destroy_virtual_joystick();
-int send_virtual_joystick_message(uint8_t keycode);
+int send_virtual_joystick_message(uint8_t keycode, uint64_t timestamp_ns);
 
 #endif //VIRTUALJOYSTICK_H
@@ -0,0 +1,185 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+// Keeps a history of key transitions in a memory mapped file. Records are
+// written to the shared mapping, so logging needs no system calls and the
+// history survives a crash of m8js. Use tools/m8js-journal to read it.
+// Only one m8js writes to a journal at a time, which an exclusive flock()
+// held while the journal is open makes sure of.
+
+#include "journal.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "footprint.h"
+
+static struct {
+    int fd;
+    struct journal_header *header;
+    struct journal_record *records;
+    size_t size;
+    uint16_t device;
+    uint8_t keys;
+    uint8_t pending_flags;
+    // converts the monotonic packet timestamps to wall clock time
+    int64_t realtime_offset_ns;
+} journal;
+
+static int header_is_valid(const struct journal_header *header) {
+    return header->magic == JOURNAL_MAGIC && header->version == JOURNAL_VERSION &&
+           header->record_size == sizeof(struct journal_record) && header->capacity == JOURNAL_RECORDS &&
+           header->device_count <= JOURNAL_DEVICES;
+}
+
+/**
+ * Finds the device in the journal's device table, adding it if needed.
+ *
+ * @return The index of the device, or -1 if the table is full.
+ */
+static int device_index(struct journal_header *header, const char *device) {
+    for (uint32_t i = 0; i < header->device_count; i++) {
+        if (strncmp(header->devices[i], device, JOURNAL_DEVICE_NAME_SIZE - 1) == 0)
+            return i;
+    }
+    if (header->device_count == JOURNAL_DEVICES)
+        return -1;
+
+    snprintf(header->devices[header->device_count], JOURNAL_DEVICE_NAME_SIZE, "%s", device);
+    return header->device_count++;
+}
+
+/**
+ * Opens or creates the journal file and maps it into memory. An existing journal is appended to.
+ *
+ * @param path Path of the journal file.
+ * @param device Name of the connected device.
+ * @return Returns 1 on success, 0 otherwise.
+ */
+int journal_open(const char *path, const char *device) {
+    const size_t size = sizeof(struct journal_header) + JOURNAL_RECORDS * sizeof(struct journal_record);
+
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return 0;
+    }
+    // the header and the sequence are updated without atomic read-modify-writes, so writers must not share a journal
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        fprintf(stderr, "Journal %s is in use by another m8js, give each M8 a journal of its own\n", path);
+        close(fd);
+        return 0;
+    }
+
+    struct journal_header existing = {0};
+    const int reuse = pread(fd, &existing, sizeof(existing), 0) == sizeof(existing) && header_is_valid(&existing);
+
+    if (!reuse && ftruncate(fd, 0) != 0) {
+        perror(path);
+        close(fd);
+        return 0;
+    }
+    if (ftruncate(fd, size) != 0) {
+        perror(path);
+        close(fd);
+        return 0;
+    }
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        perror("mmap journal");
+        close(fd);
+        return 0;
+    }
+
+    footprint_prefault(map, size);
+    journal.fd = fd;
+    journal.header = map;
+    journal.records = (struct journal_record *) (journal.header + 1);
+    journal.size = size;
+
+    if (!reuse) {
+        memset(journal.header, 0, sizeof(struct journal_header));
+        journal.header->version = JOURNAL_VERSION;
+        journal.header->record_size = sizeof(struct journal_record);
+        journal.header->capacity = JOURNAL_RECORDS;
+        journal.header->next_sequence = 1;
+        __atomic_store_n(&journal.header->magic, JOURNAL_MAGIC, __ATOMIC_RELEASE);
+    }
+    const int index = device_index(journal.header, device);
+    if (index < 0) {
+        fprintf(stderr, "Journal %s already holds %d devices, use a new journal for %s\n", path, JOURNAL_DEVICES,
+                device);
+        munmap(map, size);
+        journal.header = NULL;
+        close(fd);
+        return 0;
+    }
+    journal.device = index;
+
+    struct timespec realtime, monotonic;
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    clock_gettime(CLOCK_MONOTONIC, &monotonic);
+    journal.realtime_offset_ns = (int64_t) (realtime.tv_sec - monotonic.tv_sec) * 1000000000 +
+                                 (realtime.tv_nsec - monotonic.tv_nsec);
+
+    fprintf(stderr, "Journaling key transitions to %s\n", path);
+    return 1;
+}
+
+/**
+ * Remembers errors so that they are flagged in the next journal record.
+ *
+ * @param flags Bits from enum journal_flags.
+ */
+void journal_note_errors(const uint8_t flags) {
+    journal.pending_flags |= flags;
+}
+
+/**
+ * Records the key state if it differs from the previous one or if an error is flagged.
+ *
+ * @param keys The M8 key state bits.
+ * @param timestamp_ns Arrival time of the joypad packet in CLOCK_MONOTONIC nanoseconds.
+ * @param flags Bits from enum journal_flags concerning this key state.
+ */
+void journal_key_state(const uint8_t keys, const uint64_t timestamp_ns, const uint8_t flags) {
+    if (journal.header == NULL || (keys == journal.keys && (flags | journal.pending_flags) == 0))
+        return;
+
+    const uint64_t sequence = journal.header->next_sequence;
+    struct journal_record *record = &journal.records[(sequence - 1) % JOURNAL_RECORDS];
+
+    // invalidate the slot first, so a crash halfway leaves no mixed record behind
+    __atomic_store_n(&record->sequence, 0, __ATOMIC_RELEASE);
+    record->timestamp_ns = timestamp_ns + journal.realtime_offset_ns;
+    record->device = journal.device;
+    record->old_keys = journal.keys;
+    record->new_keys = keys;
+    record->flags = journal.pending_flags | flags;
+    __atomic_store_n(&record->sequence, sequence, __ATOMIC_RELEASE);
+    __atomic_store_n(&journal.header->next_sequence, sequence + 1, __ATOMIC_RELEASE);
+
+    journal.keys = keys;
+    journal.pending_flags = 0;
+}
+
+void journal_close() {
+    if (journal.header == NULL)
+        return;
+
+    // errors after the last key transition would otherwise never reach the journal
+    if (journal.pending_flags != 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        journal_key_state(journal.keys, (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec, 0);
+    }
+
+    munmap(journal.header, journal.size);
+    journal.header = NULL;
+    close(journal.fd);
+}
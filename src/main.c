@@ -2,6 +2,8 @@
 // Created by jonne on 9/15/24.
 //
 
+#include <getopt.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -9,9 +11,19 @@
 #include <linux/uinput.h>
 
 #include "virtualjoystick.h"
+#include "include/autofire.h"
 #include "include/command.h"
+#include "include/demand.h"
+#include "include/display.h"
+#include "include/footprint.h"
+#include "include/journal.h"
+#include "include/metrics.h"
+#include "include/probe.h"
+#include "include/scope.h"
 #include "include/serial.h"
 #include "include/slip.h"
+#include "include/textgrid.h"
+#include "include/trace.h"
 
 enum application_state { ERROR, QUIT, RUN };
 
@@ -22,10 +34,180 @@ int empty_packet_counter = 0;
 // Handles CTRL+C / SIGINT
 void intHandler() { state = QUIT; }
 
+enum long_options {
+    OPT_PROBE_INTERVAL = 256,
+    OPT_PROBE_KEYS,
+    OPT_METRICS_SOCKET,
+    OPT_METRICS_FILE,
+    OPT_TRACE,
+    OPT_JOURNAL,
+    OPT_DISPLAY_SHM,
+    OPT_TEXTGRID_SHM,
+    OPT_SCOPE_SHM,
+    OPT_TURBO,
+    OPT_AUTOREPEAT,
+    OPT_MACRO
+};
+
+static void print_usage(const char *name) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -d, --device PATH           use this serial device, a plain tty (e.g. a pty) is accepted too\n"
+            "  -p, --probe[=COUNT]         measure round trip latency with COUNT samples (default 2000) and exit\n"
+            "      --probe-interval MS     minimum time between probes (default 10)\n"
+            "      --probe-keys MASK       M8 key mask to press while probing (default 0x02, option)\n"
+            "      --metrics-socket PATH   serve Prometheus metrics on a UNIX socket\n"
+            "      --metrics-file PATH     write Prometheus metrics to a file once per second\n"
+            "      --display-shm[=NAME]    mirror the M8 screen to shared memory (default " DISPLAY_SHM_NAME ")\n"
+            "      --textgrid-shm[=NAME]   publish the screen text to shared memory (default " TEXTGRID_SHM_NAME ")\n"
+            "      --scope-shm[=NAME]      publish the oscilloscope to shared memory (default " SCOPE_SHM_NAME ")\n"
+            "      --turbo MASK:HZ         press and release held keys in MASK at HZ times per second\n"
+            "      --autorepeat MASK:DELAY_MS:HZ\n"
+            "                              press keys in MASK again at HZ once held for DELAY_MS\n"
+            "      --macro TRIGGER:STEP_MS:STATE,...\n"
+            "                              play key states STEP_MS apart when TRIGGER is pressed\n"
+            "      --journal PATH          keep a history of key transitions in a memory mapped file\n"
+            "      --trace PATH            write a Chrome trace of the serial pipeline (needs -DM8JS_TRACE=ON)\n"
+            "  -h, --help                  show this help\n",
+            name);
+}
+
+/**
+ * Waits until the serial port has data to read, the autofire timer is due or the timeout expires.
+ *
+ * @param timeout_ms Maximum time to wait in milliseconds.
+ */
+static void wait_for_input(const int timeout_ms) {
+    struct pollfd pfds[2] = {
+        {.fd = serial_get_fd(), .events = POLLIN},
+        {.fd = autofire_get_fd(), .events = POLLIN},
+    };
+    if ((pfds[0].fd < 0 && pfds[1].fd < 0) || poll(pfds, 2, timeout_ms) < 0)
+        usleep(timeout_ms * 1000);
+}
+
+/**
+ * Parses the numeric argument of an option.
+ *
+ * @param option Name of the option, for the error message.
+ * @param arg The argument.
+ * @param min Smallest accepted value.
+ * @param max Largest accepted value.
+ * @param value Set to the parsed number.
+ * @return Returns 1 on success, 0 if the argument is not a number in range.
+ */
+static int parse_option_number(const char *option, const char *arg, const unsigned long min, const unsigned long max,
+                               uint32_t *value) {
+    char *end;
+    const unsigned long n = strtoul(arg, &end, 0);
+    if (end == arg || *end != '\0' || n < min || n > max) {
+        fprintf(stderr, "Invalid value '%s' for %s, expected a number from %lu to %lu\n", arg, option, min, max);
+        return 0;
+    }
+    *value = n;
+    return 1;
+}
+
 int main(const int argc, char *argv[]) {
+    const char *preferred_device = NULL;
+    uint32_t probe_samples = 0;
+    uint32_t probe_interval_ms = 10;
+    uint8_t probe_keys = 0x02;
+    const char *metrics_socket = NULL;
+    const char *metrics_file = NULL;
+    const char *trace_file = NULL;
+    const char *journal_file = NULL;
+    const char *display_shm = NULL;
+    const char *textgrid_shm = NULL;
+    const char *scope_shm = NULL;
+
+    static const struct option options[] = {
+        {"device", required_argument, NULL, 'd'},
+        {"probe", optional_argument, NULL, 'p'},
+        {"probe-interval", required_argument, NULL, OPT_PROBE_INTERVAL},
+        {"probe-keys", required_argument, NULL, OPT_PROBE_KEYS},
+        {"metrics-socket", required_argument, NULL, OPT_METRICS_SOCKET},
+        {"metrics-file", required_argument, NULL, OPT_METRICS_FILE},
+        {"trace", required_argument, NULL, OPT_TRACE},
+        {"journal", required_argument, NULL, OPT_JOURNAL},
+        {"display-shm", optional_argument, NULL, OPT_DISPLAY_SHM},
+        {"textgrid-shm", optional_argument, NULL, OPT_TEXTGRID_SHM},
+        {"scope-shm", optional_argument, NULL, OPT_SCOPE_SHM},
+        {"turbo", required_argument, NULL, OPT_TURBO},
+        {"autorepeat", required_argument, NULL, OPT_AUTOREPEAT},
+        {"macro", required_argument, NULL, OPT_MACRO},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}
+    };
+
+    footprint_init();
+
+    int opt;
+    while ((opt = getopt_long(argc, argv, "d:p::h", options, NULL)) != -1) {
+        switch (opt) {
+            case 'd':
+                preferred_device = optarg;
+                break;
+            case 'p':
+                probe_samples = 2000;
+                if (optarg != NULL && !parse_option_number("--probe", optarg, 1, UINT32_MAX, &probe_samples))
+                    return EXIT_FAILURE;
+                break;
+            case OPT_PROBE_INTERVAL:
+                if (!parse_option_number("--probe-interval", optarg, 0, 60000, &probe_interval_ms))
+                    return EXIT_FAILURE;
+                break;
+            case OPT_PROBE_KEYS: {
+                uint32_t keys;
+                if (!parse_option_number("--probe-keys", optarg, 1, 0xFF, &keys))
+                    return EXIT_FAILURE;
+                probe_keys = keys;
+                break;
+            }
+            case OPT_METRICS_SOCKET:
+                metrics_socket = optarg;
+                break;
+            case OPT_METRICS_FILE:
+                metrics_file = optarg;
+                break;
+            case OPT_DISPLAY_SHM:
+                display_shm = optarg != NULL ? optarg : DISPLAY_SHM_NAME;
+                break;
+            case OPT_TEXTGRID_SHM:
+                textgrid_shm = optarg != NULL ? optarg : TEXTGRID_SHM_NAME;
+                break;
+            case OPT_SCOPE_SHM:
+                scope_shm = optarg != NULL ? optarg : SCOPE_SHM_NAME;
+                break;
+            case OPT_TURBO:
+                if (!autofire_add_turbo(optarg))
+                    return EXIT_FAILURE;
+                break;
+            case OPT_AUTOREPEAT:
+                if (!autofire_add_autorepeat(optarg))
+                    return EXIT_FAILURE;
+                break;
+            case OPT_MACRO:
+                if (!autofire_add_macro(optarg))
+                    return EXIT_FAILURE;
+                break;
+            case OPT_JOURNAL:
+                journal_file = optarg;
+                break;
+            case OPT_TRACE:
+                trace_file = optarg;
+                break;
+            case 'h':
+                print_usage(argv[0]);
+                return EXIT_SUCCESS;
+            default:
+                print_usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    const int probe_mode = probe_samples > 0;
 
-    // allocate memory for serial buffer
-    uint8_t *serial_buf = calloc(serial_read_size, sizeof(uint8_t));
+    static uint8_t serial_buf[serial_read_size] = {0};
     static uint8_t slip_buffer[serial_read_size] = {0};
 
     // settings for the slip packet handler
@@ -45,38 +227,90 @@ int main(const int argc, char *argv[]) {
 #endif
     slip_init(&slip, &slip_descriptor);
 
-    if (initialize_serial(1, NULL) && enable_and_reset_display() && initialize_virtual_joystick()) {
-        state = RUN;
+    int joystick_initialized = 0;
+
+    // the screen is only redrawn once something reads it, see demand.c
+    if (initialize_serial(1, preferred_device) && enable_display()) {
+        if (probe_mode) {
+            // the echoed key presses are measured, not passed on to a joystick
+            state = probe_init(probe_samples, probe_interval_ms, probe_keys) ? RUN : ERROR;
+        } else {
+            joystick_initialized = initialize_virtual_joystick();
+            state = joystick_initialized && autofire_init() ? RUN : ERROR;
+        }
     } else {
         state = ERROR;
     }
 
+    if (state == RUN && !metrics_start(metrics_socket, metrics_file, serial_port_name()))
+        state = ERROR;
+    if (state == RUN && display_shm != NULL && !display_open(display_shm))
+        state = ERROR;
+    if (state == RUN && textgrid_shm != NULL && !textgrid_open(textgrid_shm))
+        state = ERROR;
+    if (state == RUN && scope_shm != NULL && !scope_open(scope_shm))
+        state = ERROR;
+    if (state == RUN && journal_file != NULL && !journal_open(journal_file, serial_port_name()))
+        state = ERROR;
+    if (state == RUN && trace_file != NULL && !trace_open(trace_file))
+        state = ERROR;
+
+    footprint_prefault(serial_buf, sizeof(serial_buf));
+    footprint_prefault(slip_buffer, sizeof(slip_buffer));
+    footprint_start();
+
     while (state == RUN) {
         while (1) {
             empty_packet_counter = 0;
             // read serial port
-            const int bytes_read = serial_read(serial_buf, serial_read_size);
+            uint64_t arrival_ns, earliest_ns;
+            trace_begin(TRACE_SERIAL_READ);
+            const int bytes_read = serial_read(serial_buf, serial_read_size, &arrival_ns, &earliest_ns);
+            trace_end(TRACE_SERIAL_READ);
             if (bytes_read < 0) {
                 fprintf(stderr, "Error %d reading serial.", bytes_read);
                 state = QUIT;
                 break;
             }
             if (bytes_read > 0) {
+                metrics_add(serial_bytes, bytes_read);
                 // input from device: reset the zero byte counter and create a
                 // pointer to the serial buffer
+                trace_begin(TRACE_SLIP_DECODE);
                 const uint8_t *cur = serial_buf;
                 const uint8_t *end = serial_buf + bytes_read;
                 while (cur < end) {
                     // process the incoming bytes into commands and draw them
-                    const int n = slip_read_byte(&slip, *cur++);
+                    const uint64_t timestamp_ns = serial_byte_arrival_ns(arrival_ns, earliest_ns, bytes_read,
+                                                                         cur - serial_buf);
+                    const int n = slip_read_byte(&slip, *cur++, timestamp_ns);
                     if (n != SLIP_NO_ERROR) {
                         if (n == SLIP_ERROR_INVALID_PACKET) {
-                            reset_display();
+                            metrics_inc(invalid_packets);
+                            journal_note_errors(JOURNAL_INVALID_PACKET);
+                            if (demand_consumers_attached())
+                                reset_display();
+                            else
+                                metrics_inc(display_resets_skipped);
                         } else {
+                            if (n == SLIP_ERROR_BUFFER_OVERFLOW) {
+                                metrics_inc(slip_overflows);
+                                journal_note_errors(JOURNAL_SLIP_OVERFLOW);
+                            } else if (n == SLIP_ERROR_UNKNOWN_ESCAPED_BYTE) {
+                                metrics_inc(slip_bad_escapes);
+                                journal_note_errors(JOURNAL_SLIP_BAD_ESCAPE);
+                            }
                             fprintf(stderr, "SLIP error %d\n", n);
                         }
                     }
                 }
+                trace_end(TRACE_SLIP_DECODE);
+
+                textgrid_publish();
+                autofire_poll();
+
+                if (display_take_reset_request() && demand_consumers_attached())
+                    reset_display();
             } else {
                 // zero byte packet, increment counter
                 empty_packet_counter++;
@@ -89,6 +323,7 @@ int main(const int argc, char *argv[]) {
                         break;
                     }
                     state = ERROR;
+                    metrics_inc(disconnects);
                     disconnect();
                     /* we'll make one more loop to see if the device is still there
                      * but just sending zero bytes. if it doesn't get detected when
@@ -97,11 +332,31 @@ int main(const int argc, char *argv[]) {
                 break;
             }
         }
-        usleep(1000);
+        demand_poll();
+        if (probe_mode && state == RUN && !probe_poll())
+            state = QUIT;
+        wait_for_input(1);
+        autofire_poll();
     }
 
-    free(serial_buf);
-    destroy_virtual_joystick();
+    footprint_stop();
+    trace_close();
+    display_close();
+    textgrid_close();
+    scope_close();
+    journal_close();
+    metrics_stop();
+    if (probe_mode) {
+        probe_report();
+        probe_destroy();
+    }
+    autofire_report();
+    autofire_destroy();
+    // fixed footprint builds check the main loop on every run, not only when probing
+    if ((probe_mode || FOOTPRINT_FIXED) && !footprint_report(probe_mode ? stdout : stderr))
+        state = ERROR;
+    if (joystick_initialized)
+        destroy_virtual_joystick();
     if (state == ERROR) {
         return EXIT_FAILURE;
     }
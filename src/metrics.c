@@ -0,0 +1,244 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+// Serves the counters in metrics.h in Prometheus text format from a separate
+// thread, so that scraping never blocks the serial I/O loop. The metrics can be
+// read from a UNIX socket (e.g. socat - UNIX-CONNECT:path) and/or written to a
+// file once per second for node_exporter's textfile collector.
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "footprint.h"
+#include "timing.h"
+
+metrics_s metrics;
+
+static struct {
+    const char *socket_path;
+    const char *file_path;
+    char device[128];
+    int listen_fd;
+    pthread_t thread;
+    atomic_int running;
+    // the metrics are rendered here, for the file and for socket clients
+    char buf[8192];
+} server = {.listen_fd = -1};
+
+static const char *frame_type_names[METRICS_FRAME_TYPES] = {
+    "joypad", "system_info", "character", "oscilloscope", "rectangle", "unknown"
+};
+
+static uint64_t load(atomic_uint_fast64_t *value) {
+    return atomic_load_explicit(value, memory_order_relaxed);
+}
+
+/**
+ * Appends one metric family with a single sample to the output buffer.
+ *
+ * @return The number of bytes written.
+ */
+static int render_metric(char *buf, const size_t size, const char *name, const char *type, const char *help,
+                         const uint64_t value) {
+    const int n = snprintf(buf, size, "# HELP %s %s\n# TYPE %s %s\n%s{device=\"%s\"} %llu\n", name, help, name, type,
+                           name, server.device, (unsigned long long) value);
+    return n < 0 || (size_t) n >= size ? 0 : n;
+}
+
+/**
+ * Formats all metrics in Prometheus text exposition format.
+ *
+ * @param buf Output buffer.
+ * @param size Size of the output buffer.
+ * @return The length of the formatted text.
+ */
+static size_t render_metrics(char *buf, const size_t size) {
+    size_t len = 0;
+
+    len += render_metric(buf + len, size - len, "m8js_serial_bytes_total", "counter",
+                         "Bytes read from the serial port.", load(&metrics.serial_bytes));
+
+    int n = snprintf(buf + len, size - len,
+                     "# HELP m8js_frames_total Decoded packets by command type.\n"
+                     "# TYPE m8js_frames_total counter\n");
+    if (n > 0 && (size_t) n < size - len)
+        len += n;
+    for (int i = 0; i < METRICS_FRAME_TYPES; i++) {
+        n = snprintf(buf + len, size - len, "m8js_frames_total{device=\"%s\",command=\"%s\"} %llu\n", server.device,
+                     frame_type_names[i], (unsigned long long) load(&metrics.frames[i]));
+        if (n > 0 && (size_t) n < size - len)
+            len += n;
+    }
+
+    n = snprintf(buf + len, size - len,
+                 "# HELP m8js_frame_bytes_total Decoded packet bytes by command type.\n"
+                 "# TYPE m8js_frame_bytes_total counter\n");
+    if (n > 0 && (size_t) n < size - len)
+        len += n;
+    for (int i = 0; i < METRICS_FRAME_TYPES; i++) {
+        n = snprintf(buf + len, size - len, "m8js_frame_bytes_total{device=\"%s\",command=\"%s\"} %llu\n",
+                     server.device, frame_type_names[i], (unsigned long long) load(&metrics.frame_bytes[i]));
+        if (n > 0 && (size_t) n < size - len)
+            len += n;
+    }
+
+    len += render_metric(buf + len, size - len, "m8js_slip_overflows_total", "counter",
+                         "SLIP packets dropped because they did not fit the receive buffer.",
+                         load(&metrics.slip_overflows));
+    len += render_metric(buf + len, size - len, "m8js_slip_bad_escapes_total", "counter",
+                         "SLIP packets dropped because of an unknown escaped byte.", load(&metrics.slip_bad_escapes));
+    len += render_metric(buf + len, size - len, "m8js_invalid_packets_total", "counter",
+                         "Packets that could not be processed.", load(&metrics.invalid_packets));
+    len += render_metric(buf + len, size - len, "m8js_display_resets_total", "counter",
+                         "Display reset requests sent to the M8.", load(&metrics.display_resets));
+    len += render_metric(buf + len, size - len, "m8js_display_resets_skipped_total", "counter",
+                         "Display resets not requested because nothing reads the screen.",
+                         load(&metrics.display_resets_skipped));
+    len += render_metric(buf + len, size - len, "m8js_uinput_writes_total", "counter",
+                         "Key states written to the virtual joystick.", load(&metrics.uinput_writes));
+    len += render_metric(buf + len, size - len, "m8js_uinput_write_failures_total", "counter",
+                         "Failed writes to the virtual joystick.", load(&metrics.uinput_write_failures));
+    len += render_metric(buf + len, size - len, "m8js_synthetic_key_states_total", "counter",
+                         "Key states sent by turbo, autorepeat and macros.", load(&metrics.synthetic_key_states));
+    len += render_metric(buf + len, size - len, "m8js_autofire_wakeups_total", "counter",
+                         "Times the autofire timer was due.", load(&metrics.autofire_wakeups));
+    len += render_metric(buf + len, size - len, "m8js_autofire_lateness_nanoseconds_total", "counter",
+                         "Total time synthetic key states were sent after their schedule.",
+                         load(&metrics.autofire_lateness_ns));
+    len += render_metric(buf + len, size - len, "m8js_serial_disconnects_total", "counter",
+                         "Times the M8 was found to be gone.", load(&metrics.disconnects));
+    len += render_metric(buf + len, size - len, "m8js_connected", "gauge",
+                         "Whether the M8 is connected.", load(&metrics.connected));
+    len += render_metric(buf + len, size - len, "m8js_joypad_state", "gauge",
+                         "Last key state reported by the M8.", load(&metrics.joypad_state));
+    len += render_metric(buf + len, size - len, "m8js_display_consumers", "gauge",
+                         "Whether anything reads the screen data published by m8js.",
+                         load(&metrics.display_consumers));
+
+    return len;
+}
+
+/**
+ * Writes the metrics to a temporary file and renames it in place, so readers never see a partial file.
+ */
+static void write_metrics_file(char *buf, const size_t size) {
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", server.file_path);
+
+    // plain system calls, fopen() would allocate a FILE and its buffer every time
+    const int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        return;
+    const size_t len = render_metrics(buf, size);
+    const int written = write(fd, buf, len) == (ssize_t) len;
+    if (close(fd) == 0 && written)
+        rename(tmp_path, server.file_path);
+}
+
+static void *metrics_thread(void *arg) {
+    char *buf = server.buf;
+    uint64_t next_file_write = 0;
+
+    while (atomic_load(&server.running)) {
+        if (server.file_path != NULL && monotonic_ns() >= next_file_write) {
+            write_metrics_file(buf, sizeof(server.buf));
+            next_file_write = monotonic_ns() + 1000000000ull;
+        }
+
+        struct pollfd pfd = {.fd = server.listen_fd, .events = POLLIN};
+        if (server.listen_fd < 0 || poll(&pfd, 1, 200) <= 0) {
+            if (server.listen_fd < 0)
+                usleep(200000);
+            continue;
+        }
+
+        const int client = accept(server.listen_fd, NULL, NULL);
+        if (client < 0)
+            continue;
+        const size_t len = render_metrics(buf, sizeof(server.buf));
+        size_t sent = 0;
+        while (sent < len) {
+            const ssize_t n = send(client, buf + sent, len - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                break;
+            sent += n;
+        }
+        close(client);
+    }
+    return NULL;
+}
+
+/**
+ * Starts serving metrics. Does nothing if neither a socket nor a file path is given.
+ *
+ * @param socket_path Path of the UNIX socket to listen on, or NULL.
+ * @param file_path Path of the file to update once per second, or NULL.
+ * @param device Name of the connected device, used as the device label.
+ * @return Returns 1 on success, 0 otherwise.
+ */
+int metrics_start(const char *socket_path, const char *file_path, const char *device) {
+    if (socket_path == NULL && file_path == NULL)
+        return 1;
+
+    snprintf(server.device, sizeof(server.device), "%s", device);
+    for (char *c = server.device; *c; c++) {
+        if (*c == '"' || *c == '\\' || *c == '\n')
+            *c = '_';
+    }
+    server.socket_path = socket_path;
+    server.file_path = file_path;
+
+    if (socket_path != NULL) {
+        struct sockaddr_un addr = {.sun_family = AF_UNIX};
+        if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+            fprintf(stderr, "Metrics socket path too long: %s\n", socket_path);
+            return 0;
+        }
+        strcpy(addr.sun_path, socket_path);
+        unlink(socket_path);
+
+        server.listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (server.listen_fd < 0 || bind(server.listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+            listen(server.listen_fd, 8) != 0) {
+            perror("metrics socket");
+            if (server.listen_fd >= 0)
+                close(server.listen_fd);
+            server.listen_fd = -1;
+            return 0;
+        }
+    }
+
+    atomic_store(&server.running, 1);
+    footprint_prefault(server.buf, sizeof(server.buf));
+    if (pthread_create(&server.thread, NULL, metrics_thread, NULL) != 0) {
+        fprintf(stderr, "Cannot start metrics thread\n");
+        atomic_store(&server.running, 0);
+        return 0;
+    }
+
+    fprintf(stderr, "Serving metrics%s%s%s%s\n", socket_path ? " on " : "", socket_path ? socket_path : "",
+            file_path ? " to " : "", file_path ? file_path : "");
+    return 1;
+}
+
+void metrics_stop() {
+    if (!atomic_load(&server.running))
+        return;
+
+    atomic_store(&server.running, 0);
+    pthread_join(server.thread, NULL);
+
+    if (server.listen_fd >= 0) {
+        close(server.listen_fd);
+        unlink(server.socket_path);
+        server.listen_fd = -1;
+    }
+}
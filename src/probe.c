@@ -0,0 +1,133 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+// Round-trip latency probe: sends controller states to the M8 and times how long
+// it takes for the matching joypad state packet to come back.
+
+#include "probe.h"
+
+#include <stdio.h>
+
+#include "serial.h"
+#include "stats.h"
+#include "timing.h"
+
+// A probe that hasn't been answered in this time is counted as lost
+#define PROBE_TIMEOUT_NS 250000000ull
+
+static struct {
+    int running;
+    uint32_t samples;
+    uint32_t sent;
+    uint32_t lost;
+    uint32_t unexpected;
+    uint32_t misdated;
+    uint64_t interval_ns;
+    uint8_t keys;
+    uint8_t expected;
+    int outstanding;
+    uint64_t sent_at;
+    latency_stats_s rtt;
+} probe;
+
+/**
+ * Prepares a probe run.
+ *
+ * @param samples Number of controller states to send.
+ * @param interval_ms Minimum time between consecutive probes in milliseconds.
+ * @param keys The key mask to press. Probes alternate between this mask and no keys.
+ * @return Returns 1 on success, 0 otherwise.
+ */
+int probe_init(const uint32_t samples, const uint32_t interval_ms, const uint8_t keys) {
+    if (samples == 0 || keys == 0) {
+        fprintf(stderr, "Probe needs a non-zero sample count and key mask\n");
+        return 0;
+    }
+    if (!latency_stats_init(&probe.rtt, samples))
+        return 0;
+
+    probe.samples = samples;
+    probe.interval_ns = (uint64_t) interval_ms * 1000000ull;
+    probe.keys = keys;
+    probe.running = 1;
+
+    fprintf(stderr, "Probing round trip latency with %u samples, key mask 0x%02X\n", samples, keys);
+    return 1;
+}
+
+int probe_is_running() { return probe.running; }
+
+/**
+ * Sends the next probe when the previous one has been answered or has timed out.
+ * Called from the main loop.
+ *
+ * @return Returns 1 while the probe is still running, 0 when it has finished or failed.
+ */
+int probe_poll() {
+    if (!probe.running)
+        return 0;
+
+    const uint64_t now = monotonic_ns();
+
+    if (probe.outstanding) {
+        if (now - probe.sent_at < PROBE_TIMEOUT_NS)
+            return 1;
+        probe.outstanding = 0;
+        probe.lost++;
+    }
+
+    if (probe.sent >= probe.samples) {
+        // release all keys before leaving
+        send_msg_controller(0);
+        probe.running = 0;
+        return 0;
+    }
+
+    if (probe.sent > 0 && now - probe.sent_at < probe.interval_ns)
+        return 1;
+
+    probe.expected = probe.sent % 2 == 0 ? probe.keys : 0;
+    probe.sent_at = monotonic_ns();
+    if (send_msg_controller(probe.expected) != 1) {
+        probe.running = 0;
+        return 0;
+    }
+    probe.sent++;
+    probe.outstanding = 1;
+    return 1;
+}
+
+/**
+ * Matches a joypad state packet from the M8 against the outstanding probe.
+ *
+ * @param keys The key state reported by the M8.
+ * @param timestamp_ns Arrival time of the joypad state packet.
+ */
+void probe_on_joypad_state(const uint8_t keys, const uint64_t timestamp_ns) {
+    if (!probe.outstanding || keys != probe.expected) {
+        probe.unexpected++;
+        return;
+    }
+    probe.outstanding = 0;
+    // the arrival time is an estimate, an answer dated before its probe has no usable round trip time
+    if (timestamp_ns < probe.sent_at) {
+        probe.misdated++;
+        return;
+    }
+    latency_stats_add(&probe.rtt, timestamp_ns - probe.sent_at);
+}
+
+/**
+ * Prints the round trip time distribution to stdout.
+ */
+void probe_report() {
+    printf("Probes sent %u, answered %u, lost %u, unexpected joypad packets %u\n", probe.sent, probe.rtt.count,
+           probe.lost, probe.unexpected);
+    if (probe.misdated > 0)
+        printf("Answers dated before their probe, not counted: %u\n", probe.misdated);
+    latency_stats_print(&probe.rtt, "Round trip time", stdout);
+}
+
+void probe_destroy() {
+    latency_stats_free(&probe.rtt);
+    probe.running = 0;
+}
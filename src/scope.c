@@ -0,0 +1,180 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+// Oscilloscope tap. The waveform bytes of 0xFC packets are the y coordinates
+// of the scope on screen; they are converted to signed samples around the
+// middle of the scope area and written to a ring in shared memory.
+
+#include "scope.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "demand.h"
+#include "screen.h"
+#include "shm.h"
+
+static struct {
+    struct scope_header *shm;
+    int fd;
+    char name[64];
+    uint8_t height;
+} scope;
+
+#if defined(__SSE2__)
+/**
+ * Converts eight signed 16-bit values to floats and stores them scaled.
+ */
+static inline void store_scaled_floats(float *dest, const __m128i values, const __m128 scale) {
+    // interleaving a value with itself and shifting right sign extends it to 32 bits
+    const __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(values, values), 16);
+    const __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(values, values), 16);
+    _mm_storeu_ps(dest, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+    _mm_storeu_ps(dest + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+}
+#endif
+
+/**
+ * Converts waveform y coordinates to samples, 16 at a time where SIMD is available.
+ *
+ * @param waveform The y coordinates, 0 at the top of the scope.
+ * @param count Number of coordinates.
+ * @param height Height of the scope area; coordinates are clamped to it.
+ * @param samples Output scaled to -1.0 ... 1.0.
+ * @param samples_s16 Output scaled to -32767 ... 32767.
+ */
+static void unpack_waveform(const uint8_t *waveform, const uint32_t count, const uint8_t height, float *samples,
+                            int16_t *samples_s16) {
+    const int16_t center = height / 2;
+    const int16_t scale_s16 = 32767 / center;
+    const float scale = 1.0f / center;
+    uint32_t i = 0;
+
+#if defined(__SSE2__)
+    const __m128i max = _mm_set1_epi8((char) height);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i centers = _mm_set1_epi16(center);
+    const __m128i scales = _mm_set1_epi16(scale_s16);
+    const __m128 scales_f = _mm_set1_ps(scale);
+
+    for (; i + 16 <= count; i += 16) {
+        const __m128i y = _mm_min_epu8(_mm_loadu_si128((const __m128i *) &waveform[i]), max);
+        const __m128i lo = _mm_sub_epi16(centers, _mm_unpacklo_epi8(y, zero));
+        const __m128i hi = _mm_sub_epi16(centers, _mm_unpackhi_epi8(y, zero));
+
+        _mm_storeu_si128((__m128i *) &samples_s16[i], _mm_mullo_epi16(lo, scales));
+        _mm_storeu_si128((__m128i *) &samples_s16[i + 8], _mm_mullo_epi16(hi, scales));
+
+        store_scaled_floats(&samples[i], lo, scales_f);
+        store_scaled_floats(&samples[i + 8], hi, scales_f);
+    }
+#elif defined(__ARM_NEON)
+    const uint8x16_t max = vdupq_n_u8(height);
+    const int16x8_t centers = vdupq_n_s16(center);
+
+    for (; i + 16 <= count; i += 16) {
+        const uint8x16_t y = vminq_u8(vld1q_u8(&waveform[i]), max);
+        const int16x8_t lo = vsubq_s16(centers, vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(y))));
+        const int16x8_t hi = vsubq_s16(centers, vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(y))));
+
+        vst1q_s16(&samples_s16[i], vmulq_n_s16(lo, scale_s16));
+        vst1q_s16(&samples_s16[i + 8], vmulq_n_s16(hi, scale_s16));
+
+        vst1q_f32(&samples[i], vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(lo))), scale));
+        vst1q_f32(&samples[i + 4], vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(lo))), scale));
+        vst1q_f32(&samples[i + 8], vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(hi))), scale));
+        vst1q_f32(&samples[i + 12], vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(hi))), scale));
+    }
+#endif
+
+    for (; i < count; i++) {
+        const int16_t sample = center - (waveform[i] > height ? height : waveform[i]);
+        samples_s16[i] = sample * scale_s16;
+        samples[i] = sample * scale;
+    }
+}
+
+/**
+ * Opens the shared memory segment for the oscilloscope tap.
+ *
+ * @param name Name of the POSIX shared memory segment, e.g. SCOPE_SHM_NAME.
+ * @return Returns 1 on success, 0 otherwise.
+ */
+int scope_open(const char *name) {
+    int fd;
+    void *map = shm_create_segment(name, sizeof(struct scope_header), "scope", &fd);
+    if (map == NULL)
+        return 0;
+
+    scope.shm = map;
+    scope.fd = fd;
+    demand_watch(fd);
+    snprintf(scope.name, sizeof(scope.name), "%s", name);
+    memset(scope.shm, 0, sizeof(struct scope_header));
+    scope.shm->version = SCOPE_VERSION;
+    scope.shm->slots = SCOPE_SLOTS;
+    // no frame has number 0 until the first one is written
+    for (uint32_t i = 0; i < SCOPE_SLOTS; i++)
+        scope.shm->frames[i].frame_number = UINT64_MAX;
+    scope_set_hardware(0);
+    __atomic_store_n(&scope.shm->magic, SCOPE_MAGIC, __ATOMIC_RELEASE);
+
+    fprintf(stderr, "Publishing the oscilloscope to shared memory %s\n", name);
+    return 1;
+}
+
+/**
+ * Sets the scope height for a hardware type reported in the system info packet.
+ */
+void scope_set_hardware(const uint8_t hardware_type) {
+    scope.height = screen_geometry(hardware_type)->waveform_height;
+}
+
+/**
+ * Writes the waveform of an oscilloscope packet to the next slot of the ring.
+ *
+ * @param data The packet: command byte, colour and waveform bytes.
+ * @param size Size of the packet.
+ * @param timestamp_ns Arrival time of the packet.
+ */
+void scope_push(const uint8_t *data, const uint32_t size, const uint64_t timestamp_ns) {
+    if (scope.shm == NULL)
+        return;
+
+    uint32_t count = size - 4;
+    if (count > SCOPE_MAX_SAMPLES)
+        count = SCOPE_MAX_SAMPLES;
+
+    const uint64_t frame_number = scope.shm->frame_count;
+    struct scope_frame *frame = &scope.shm->frames[frame_number & (SCOPE_SLOTS - 1)];
+    const uint64_t sequence = frame->sequence;
+
+    __atomic_store_n(&frame->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    frame->frame_number = frame_number;
+    frame->timestamp_ns = timestamp_ns;
+    frame->sample_count = count;
+    memcpy(frame->color, &data[1], 3);
+    unpack_waveform(&data[4], count, scope.height, frame->samples, frame->samples_s16);
+
+    __atomic_store_n(&frame->sequence, sequence + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&scope.shm->frame_count, frame_number + 1, __ATOMIC_RELEASE);
+}
+
+void scope_close() {
+    if (scope.shm == NULL)
+        return;
+
+    munmap(scope.shm, sizeof(struct scope_header));
+    close(scope.fd);
+    shm_unlink(scope.name);
+    scope.shm = NULL;
+}
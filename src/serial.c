@@ -4,16 +4,27 @@
 // Contains portions of code from libserialport's examples released to the
 // public domain
 
+#include <errno.h>
+#include <fcntl.h>
 #include <libserialport.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <termios.h>
 #include <unistd.h>
 
+#include "include/metrics.h"
 #include "include/serial.h"
+#include "include/timing.h"
 
 struct sp_port *m8_port = NULL;
 
+/* A plain tty opened without libserialport, e.g. a pty standing in for the M8.
+ * libserialport looks ports up in sysfs, which pseudo terminals are not part of. */
+static int tty_fd = -1;
+static char tty_name[PATH_MAX];
+
 // Helper function for error handling
 static int check(enum sp_return result);
 
@@ -47,6 +58,14 @@ static int detect_m8_serial_device(const struct sp_port *m8_port) {
 int check_serial_port() {
     int device_found = 0;
 
+    if (tty_fd >= 0)
+        return access(tty_name, F_OK) == 0;
+
+#ifdef M8JS_FIXED_FOOTPRINT
+    // listing the ports allocates memory, so only check that the device node is still there
+    (void) device_found;
+    return access(sp_get_port_name(m8_port), F_OK) == 0;
+#else
     /* A pointer to a null-terminated array of pointers to
      * struct sp_port, which will contain the ports found.*/
     struct sp_port **port_list;
@@ -73,6 +92,45 @@ int check_serial_port() {
 
     sp_free_port_list(port_list);
     return device_found;
+#endif
+}
+
+/**
+ * Opens a tty device directly and configures it for raw 8N1 communication.
+ *
+ * @param path Path to the tty device.
+ * @return Returns 1 if the device was opened, otherwise returns 0.
+ */
+static int open_tty_device(const char *path) {
+    tty_fd = open(path, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (tty_fd < 0) {
+        perror(path);
+        return 0;
+    }
+
+    struct termios tio;
+    if (tcgetattr(tty_fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetspeed(&tio, B115200);
+        tcsetattr(tty_fd, TCSANOW, &tio);
+    }
+
+    snprintf(tty_name, sizeof(tty_name), "%s", path);
+    fprintf(stderr, "Opened %s as a plain tty\n", path);
+    return 1;
+}
+
+/**
+ * Writes a command to the M8.
+ *
+ * @param buf The bytes to write.
+ * @param nbytes Number of bytes to write.
+ * @return The number of bytes written, or a negative value if there is an error.
+ */
+static int port_write(const char *buf, const size_t nbytes) {
+    if (tty_fd >= 0)
+        return (int) write(tty_fd, buf, nbytes);
+    return sp_blocking_write(m8_port, buf, nbytes, 5);
 }
 
 /**
@@ -80,10 +138,11 @@ int check_serial_port() {
  *
  * @param verbose If non-zero, additional debug information will be printed to stderr.
  * @param preferred_device A string representing the preferred device name; if found, iteration stops early.
+ *                         If it is not one of the M8s found, the device is opened as a plain tty.
  * @return Returns 1 if the serial port initialization is successful; otherwise returns 0.
  */
 int initialize_serial(const int verbose, const char *preferred_device) {
-    if (m8_port != NULL) {
+    if (m8_port != NULL || tty_fd >= 0) {
         // Port is already initialized
         return 1;
     }
@@ -121,6 +180,12 @@ int initialize_serial(const int verbose, const char *preferred_device) {
 
     sp_free_port_list(port_list);
 
+    if (preferred_device != NULL && m8_port != NULL && strcmp(sp_get_port_name(m8_port), preferred_device) != 0) {
+        // never fall back to another M8 than the one asked for
+        sp_free_port(m8_port);
+        m8_port = NULL;
+    }
+
     if (m8_port != NULL) {
         // Open the serial port and configure it
         fprintf(stderr, "Opening port\n");
@@ -129,7 +194,7 @@ int initialize_serial(const int verbose, const char *preferred_device) {
         if (check(result) != SP_OK)
             return 0;
 
-        result = sp_set_baudrate(m8_port, 115200);
+        result = sp_set_baudrate(m8_port, serial_baud_rate);
         if (check(result) != SP_OK)
             return 0;
 
@@ -148,6 +213,12 @@ int initialize_serial(const int verbose, const char *preferred_device) {
         result = sp_set_flowcontrol(m8_port, SP_FLOWCONTROL_NONE);
         if (check(result) != SP_OK)
             return 0;
+
+        metrics_set(connected, 1);
+    } else if (preferred_device != NULL) {
+        const int result = open_tty_device(preferred_device);
+        metrics_set(connected, result);
+        return result;
     } else {
         if (verbose) {
             fprintf(stderr, "Cannot find a M8.\n");
@@ -196,9 +267,10 @@ static int check(const enum sp_return result) {
  */
 int reset_display() {
     fprintf(stderr, "Reset display\n");
+    metrics_inc(display_resets);
 
     const char buf[1] = {'R'};
-    const int result = sp_blocking_write(m8_port, buf, 1, 5);
+    const int result = port_write(buf, 1);
     if (result != 1) {
         fprintf(stderr, "Error resetting M8 display, code %d", result);
         return 0;
@@ -207,23 +279,33 @@ int reset_display() {
 }
 
 /**
- * Enables the M8 display and then resets it.
+ * Enables the M8 display without asking for a full redraw. The M8 only sends
+ * key states while the display is enabled.
  *
- * @return Returns 1 if both enabling and resetting the display are successful, otherwise returns 0.
+ * @return Returns 1 if the enable command was successfully written to the serial port, otherwise returns 0.
  */
-int enable_and_reset_display() {
-    fprintf(stderr, "Enabling and resetting M8 display\n");
+int enable_display() {
+    fprintf(stderr, "Enabling M8 display\n");
 
     const char buf[1] = {'E'};
-    int result = sp_blocking_write(m8_port, buf, 1, 5);
+    const int result = port_write(buf, 1);
     if (result != 1) {
         fprintf(stderr, "Error enabling M8 display, code %d", result);
         return 0;
     }
+    return 1;
+}
 
-    result = reset_display();
+/**
+ * Enables the M8 display and then resets it.
+ *
+ * @return Returns 1 if both enabling and resetting the display are successful, otherwise returns 0.
+ */
+int enable_and_reset_display() {
+    if (!enable_display())
+        return 0;
 
-    return result;
+    return reset_display();
 }
 
 /**
@@ -233,14 +315,20 @@ int enable_and_reset_display() {
  */
 int disconnect() {
     fprintf(stderr, "Disconnecting M8\n");
+    metrics_set(connected, 0);
 
     const char buf[1] = {'D'};
 
-    int result = sp_blocking_write(m8_port, buf, 1, 5);
+    int result = port_write(buf, 1);
     if (result != 1) {
         fprintf(stderr, "Error sending disconnect, code %d", result);
         result = 0;
     }
+    if (tty_fd >= 0) {
+        close(tty_fd);
+        tty_fd = -1;
+        return result;
+    }
     sp_close(m8_port);
     sp_free_port(m8_port);
     m8_port = NULL;
@@ -252,10 +340,54 @@ int disconnect() {
  *
  * @param serial_buf A pointer to a buffer where the read data will be stored.
  * @param count The number of bytes to attempt to read from the serial port.
+ * @param arrival_ns Set to the CLOCK_MONOTONIC time in nanoseconds when the read returned.
+ * @param earliest_ns Set to the time the previous read returned. The bytes read now were not there
+ *                    yet, unless the previous read filled its whole buffer.
  * @return The number of bytes read, or a negative value if there is an error.
  */
-int serial_read(uint8_t *serial_buf, const int count) {
-    return sp_nonblocking_read(m8_port, serial_buf, count);
+int serial_read(uint8_t *serial_buf, const int count, uint64_t *arrival_ns, uint64_t *earliest_ns) {
+    static uint64_t previous_read_ns;
+    int result;
+
+    if (tty_fd >= 0) {
+        result = (int) read(tty_fd, serial_buf, count);
+        if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            result = 0;
+    } else {
+        result = sp_nonblocking_read(m8_port, serial_buf, count);
+    }
+    *arrival_ns = monotonic_ns();
+    *earliest_ns = previous_read_ns;
+    previous_read_ns = *arrival_ns;
+    return result;
+}
+
+/**
+ * Returns the name of the open serial port.
+ *
+ * @return The port name, or an empty string if no port is open.
+ */
+const char *serial_port_name() {
+    if (tty_fd >= 0)
+        return tty_name;
+    if (m8_port != NULL)
+        return sp_get_port_name(m8_port);
+    return "";
+}
+
+/**
+ * Returns the file descriptor of the open serial port, for use with poll().
+ *
+ * @return The file descriptor, or -1 if no port is open.
+ */
+int serial_get_fd() {
+    if (tty_fd >= 0)
+        return tty_fd;
+
+    int fd = -1;
+    if (m8_port == NULL || sp_get_port_handle(m8_port, &fd) != SP_OK)
+        return -1;
+    return fd;
 }
 
 /**
@@ -267,7 +399,7 @@ int serial_read(uint8_t *serial_buf, const int count) {
 int send_msg_controller(const uint8_t input) {
     const char buf[2] = {'C', input};
     const size_t nbytes = 2;
-    const int result = sp_blocking_write(m8_port, buf, nbytes, 5);
+    const int result = port_write(buf, nbytes);
     if (result != nbytes) {
         fprintf(stderr, "Error sending input, code %d", result);
         return -1;
@@ -287,7 +419,7 @@ int send_msg_keyjazz(const uint8_t note, uint8_t velocity) {
         velocity = 0x7F;
     const char buf[3] = {'K', note, velocity};
     const size_t nbytes = 3;
-    const int result = sp_blocking_write(m8_port, buf, nbytes, 5);
+    const int result = port_write(buf, nbytes);
     if (result != nbytes) {
         fprintf(stderr, "Error sending keyjazz, code %d", result);
         return -1;
@@ -0,0 +1,47 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+// Creates the POSIX shared memory segments the screen data is published in.
+
+#include "shm.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/**
+ * Creates or reuses a shared memory segment, sizes it and maps it read-write.
+ * On failure the segment is removed again.
+ *
+ * @param name Name of the POSIX shared memory segment.
+ * @param size Size of the segment.
+ * @param what Name of the segment in error messages, e.g. "display".
+ * @param fd Receives the file descriptor of the segment, which the caller keeps open.
+ * @return Returns the mapping on success, NULL otherwise.
+ */
+void *shm_create_segment(const char *name, const size_t size, const char *what, int *fd) {
+    char context[64];
+
+    *fd = shm_open(name, O_CREAT | O_RDWR | O_CLOEXEC, 0644);
+    if (*fd < 0) {
+        snprintf(context, sizeof(context), "shm_open %s", what);
+        perror(context);
+        return NULL;
+    }
+    if (ftruncate(*fd, size) != 0) {
+        snprintf(context, sizeof(context), "ftruncate %s", what);
+        perror(context);
+        close(*fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if (map == MAP_FAILED) {
+        snprintf(context, sizeof(context), "mmap %s", what);
+        perror(context);
+        close(*fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    return map;
+}
@@ -66,7 +66,7 @@ static slip_error_t put_byte_to_buffer(slip_handler_s *slip, const uint8_t byte)
   return error;
 }
 
-slip_error_t slip_read_byte(slip_handler_s *slip, uint8_t byte) {
+slip_error_t slip_read_byte(slip_handler_s *slip, uint8_t byte, uint64_t timestamp_ns) {
   slip_error_t error = SLIP_NO_ERROR;
 
   assert(slip != NULL);
@@ -75,7 +75,7 @@ slip_error_t slip_read_byte(slip_handler_s *slip, uint8_t byte) {
   case SLIP_STATE_NORMAL:
     switch (byte) {
     case SLIP_SPECIAL_BYTE_END:
-      if (!slip->descriptor->recv_message(slip->descriptor->buf, slip->size)) {
+      if (!slip->descriptor->recv_message(slip->descriptor->buf, slip->size, timestamp_ns)) {
         error = SLIP_ERROR_INVALID_PACKET;
       }
       reset_rx(slip);
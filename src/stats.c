@@ -0,0 +1,121 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+#include "stats.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "footprint.h"
+
+#ifdef M8JS_FIXED_FOOTPRINT
+static struct {
+    uint64_t samples[LATENCY_STATS_POOL_SAMPLES];
+    uint32_t used;
+} pool;
+#endif
+
+static int compare_u64(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *) a;
+    const uint64_t y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Returns the sample at the given percentile from a sorted sample array.
+ */
+static uint64_t percentile(const uint64_t *sorted, const uint32_t count, const double p) {
+    uint32_t index = (uint32_t) (p / 100.0 * (count - 1) + 0.5);
+    if (index >= count)
+        index = count - 1;
+    return sorted[index];
+}
+
+/**
+ * Allocates storage for a set of latency samples. M8JS_FIXED_FOOTPRINT builds take it from a static
+ * pool of LATENCY_STATS_POOL_SAMPLES samples instead of the heap.
+ *
+ * @param stats The statistics structure to initialize.
+ * @param capacity Maximum number of samples to keep. Samples beyond this are dropped.
+ * @return Returns 1 on success, 0 if the sample storage could not be allocated.
+ */
+int latency_stats_init(latency_stats_s *stats, const uint32_t capacity) {
+    memset(stats, 0, sizeof(*stats));
+#ifdef M8JS_FIXED_FOOTPRINT
+    if (capacity > LATENCY_STATS_POOL_SAMPLES - pool.used) {
+        fprintf(stderr, "Cannot keep %u latency samples, a fixed footprint build has room for %u more\n", capacity,
+                LATENCY_STATS_POOL_SAMPLES - pool.used);
+        return 0;
+    }
+    stats->samples = &pool.samples[pool.used];
+    pool.used += capacity;
+#else
+    stats->samples = calloc(capacity, sizeof(uint64_t));
+    if (stats->samples == NULL) {
+        fprintf(stderr, "Cannot allocate memory for %u latency samples\n", capacity);
+        return 0;
+    }
+#endif
+    stats->capacity = capacity;
+    footprint_prefault(stats->samples, capacity * sizeof(uint64_t));
+    return 1;
+}
+
+/**
+ * Adds a sample. Jitter is tracked as the mean absolute difference between consecutive samples.
+ *
+ * @param stats The statistics structure.
+ * @param ns The sample value in nanoseconds.
+ */
+void latency_stats_add(latency_stats_s *stats, const uint64_t ns) {
+    if (stats->count >= stats->capacity)
+        return;
+
+    if (stats->count > 0)
+        stats->jitter_sum += ns > stats->last ? (double) (ns - stats->last) : (double) (stats->last - ns);
+
+    stats->samples[stats->count++] = ns;
+    stats->last = ns;
+    stats->sum += (double) ns;
+    stats->sum_sq += (double) ns * (double) ns;
+}
+
+/**
+ * Prints a summary of the collected samples in microseconds. Sorts the samples in place.
+ *
+ * @param stats The statistics structure.
+ * @param name A label for the printed summary.
+ * @param out The stream to print to.
+ */
+void latency_stats_print(latency_stats_s *stats, const char *name, FILE *out) {
+    const uint32_t n = stats->count;
+
+    if (n == 0) {
+        fprintf(out, "%s: no samples\n", name);
+        return;
+    }
+
+    const double mean = stats->sum / n;
+    double variance = stats->sum_sq / n - mean * mean;
+    if (variance < 0)
+        variance = 0;
+    const double jitter = n > 1 ? stats->jitter_sum / (n - 1) : 0;
+
+    qsort(stats->samples, n, sizeof(uint64_t), compare_u64);
+
+    fprintf(out, "%s: %u samples (usec)\n", name, n);
+    fprintf(out, "  min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+            stats->samples[0] / 1e3, percentile(stats->samples, n, 50) / 1e3,
+            percentile(stats->samples, n, 90) / 1e3, percentile(stats->samples, n, 99) / 1e3,
+            percentile(stats->samples, n, 99.9) / 1e3, stats->samples[n - 1] / 1e3);
+    fprintf(out, "  mean %.1f  stddev %.1f  jitter %.1f\n", mean / 1e3, sqrt(variance) / 1e3, jitter / 1e3);
+}
+
+void latency_stats_free(latency_stats_s *stats) {
+#ifdef M8JS_FIXED_FOOTPRINT
+    // the pool is only handed out once, at startup
+#else
+    free(stats->samples);
+#endif
+    memset(stats, 0, sizeof(*stats));
+}
@@ -0,0 +1,187 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+// Text grid model of the M8 screen. Character packets are decoded straight
+// into the grid in shared memory; the changes of each serial read are
+// published together as one generation.
+
+#include "textgrid.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "command.h"
+#include "demand.h"
+#include "screen.h"
+#include "shm.h"
+
+static struct {
+    struct textgrid_header *shm;
+    int fd;
+    char name[64];
+    const struct screen_geometry *geometry;
+    uint32_t dirty_rows;
+    uint8_t rectangle_color[3];
+} textgrid;
+
+/**
+ * Marks the grid as being updated, once per batch of changes.
+ */
+static void begin_update(const uint32_t row) {
+    if (textgrid.dirty_rows == 0) {
+        __atomic_store_n(&textgrid.shm->sequence, textgrid.shm->sequence + 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+    }
+    textgrid.dirty_rows |= 1u << row;
+}
+
+static void set_cell(const uint32_t row, const uint32_t column, const struct textgrid_cell *cell) {
+    struct textgrid_cell *current = &textgrid.shm->cells[row][column];
+    if (memcmp(current, cell, sizeof(*cell)) == 0)
+        return;
+
+    begin_update(row);
+    *current = *cell;
+}
+
+/**
+ * Opens the shared memory segment for the text grid.
+ *
+ * @param name Name of the POSIX shared memory segment, e.g. TEXTGRID_SHM_NAME.
+ * @return Returns 1 on success, 0 otherwise.
+ */
+int textgrid_open(const char *name) {
+    int fd;
+    void *map = shm_create_segment(name, sizeof(struct textgrid_header), "text grid", &fd);
+    if (map == NULL)
+        return 0;
+
+    textgrid.shm = map;
+    textgrid.fd = fd;
+    demand_watch(fd);
+    snprintf(textgrid.name, sizeof(textgrid.name), "%s", name);
+    memset(textgrid.shm, 0, sizeof(struct textgrid_header));
+    textgrid.shm->version = TEXTGRID_VERSION;
+    textgrid_set_hardware(0);
+    __atomic_store_n(&textgrid.shm->magic, TEXTGRID_MAGIC, __ATOMIC_RELEASE);
+
+    fprintf(stderr, "Publishing the text grid to shared memory %s\n", name);
+    return 1;
+}
+
+/**
+ * Sets the grid size for a hardware type reported in the system info packet.
+ */
+void textgrid_set_hardware(const uint8_t hardware_type) {
+    if (textgrid.shm == NULL || textgrid.geometry == screen_geometry(hardware_type))
+        return;
+
+    textgrid.geometry = screen_geometry(hardware_type);
+    const uint16_t columns = textgrid.geometry->width / textgrid.geometry->cell_width;
+    const uint16_t rows = textgrid.geometry->height / textgrid.geometry->cell_height;
+    textgrid.shm->columns = columns < TEXTGRID_MAX_COLUMNS ? columns : TEXTGRID_MAX_COLUMNS;
+    textgrid.shm->rows = rows < TEXTGRID_MAX_ROWS ? rows : TEXTGRID_MAX_ROWS;
+
+    for (uint32_t row = 0; row < TEXTGRID_MAX_ROWS; row++)
+        begin_update(row);
+    memset(textgrid.shm->cells, 0, sizeof(textgrid.shm->cells));
+}
+
+/**
+ * Stores a character from a draw character packet in the grid.
+ *
+ * @param data The packet, draw_character_command_datalength bytes.
+ * @param timestamp_ns Arrival time of the packet.
+ */
+void textgrid_draw_character(const uint8_t *data, const uint64_t timestamp_ns) {
+    if (textgrid.shm == NULL)
+        return;
+
+    const uint32_t column = screen_read_u16(data, 2) / textgrid.geometry->cell_width;
+    const uint32_t row = screen_read_u16(data, 4) / textgrid.geometry->cell_height;
+    if (column >= textgrid.shm->columns || row >= textgrid.shm->rows)
+        return;
+
+    const struct textgrid_cell cell = {
+        .c = data[1],
+        .foreground = {data[6], data[7], data[8]},
+        .background = {data[9], data[10], data[11]},
+    };
+    set_cell(row, column, &cell);
+    textgrid.shm->timestamp_ns = timestamp_ns;
+}
+
+/**
+ * Clears the cells completely covered by a draw rectangle packet.
+ *
+ * @param data The packet.
+ * @param size Size of the packet.
+ */
+void textgrid_draw_rectangle(const uint8_t *data, const uint32_t size) {
+    if (textgrid.shm == NULL)
+        return;
+
+    // only packets of 8 and 12 bytes carry a colour, the others reuse the previous one
+    if (size == 8)
+        memcpy(textgrid.rectangle_color, &data[5], 3);
+    else if (size == 12)
+        memcpy(textgrid.rectangle_color, &data[9], 3);
+
+    // single pixels never cover a cell
+    if (size != 9 && size != 12)
+        return;
+
+    const struct screen_geometry *geometry = textgrid.geometry;
+    const uint32_t x = screen_read_u16(data, 1);
+    const uint32_t y = screen_read_u16(data, 3);
+    const uint32_t first_column = (x + geometry->cell_width - 1) / geometry->cell_width;
+    const uint32_t first_row = (y + geometry->cell_height - 1) / geometry->cell_height;
+    uint32_t end_column = (x + screen_read_u16(data, 5)) / geometry->cell_width;
+    uint32_t end_row = (y + screen_read_u16(data, 7)) / geometry->cell_height;
+    if (end_column > textgrid.shm->columns)
+        end_column = textgrid.shm->columns;
+    if (end_row > textgrid.shm->rows)
+        end_row = textgrid.shm->rows;
+
+    struct textgrid_cell cell = {.c = ' '};
+    memcpy(cell.foreground, textgrid.rectangle_color, 3);
+    memcpy(cell.background, textgrid.rectangle_color, 3);
+    for (uint32_t row = first_row; row < end_row; row++) {
+        for (uint32_t column = first_column; column < end_column; column++)
+            set_cell(row, column, &cell);
+    }
+}
+
+/**
+ * Publishes the changes made since the last call as a new generation and wakes up waiting
+ * consumers. Called after each serial read.
+ */
+void textgrid_publish() {
+    if (textgrid.shm == NULL || textgrid.dirty_rows == 0)
+        return;
+
+    struct textgrid_header *shm = textgrid.shm;
+    const uint32_t generation = shm->generation + 1;
+
+    for (uint32_t row = 0; row < TEXTGRID_MAX_ROWS; row++) {
+        if (textgrid.dirty_rows & 1u << row)
+            __atomic_store_n(&shm->row_generation[row], generation, __ATOMIC_RELAXED);
+    }
+    shm->dirty_rows = textgrid.dirty_rows;
+    __atomic_store_n(&shm->sequence, shm->sequence + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&shm->generation, generation, __ATOMIC_SEQ_CST);
+    textgrid.dirty_rows = 0;
+
+    if (__atomic_load_n(&shm->waiters, __ATOMIC_SEQ_CST) > 0)
+        syscall(SYS_futex, &shm->generation, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+void textgrid_close() {
+    if (textgrid.shm == NULL)
+        return;
+
+    munmap(textgrid.shm, sizeof(struct textgrid_header));
+    close(textgrid.fd);
+    shm_unlink(textgrid.name);
+    textgrid.shm = NULL;
+}
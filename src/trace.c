@@ -0,0 +1,212 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+// Pipeline tracing, built with -DM8JS_TRACE=ON. Each thread records spans into
+// its own ring buffer without locking; a writer thread drains the rings every
+// 100 ms into a Chrome trace JSON file, which can be opened in chrome://tracing
+// or ui.perfetto.dev. The file is written in the JSON array format, which stays
+// readable even if m8js exits without closing it.
+
+#include "trace.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "footprint.h"
+
+// Events per thread, must be a power of two
+#ifdef M8JS_FIXED_FOOTPRINT
+#define TRACE_RING_SIZE 4096
+// a fixed footprint build has static rings for this many threads
+#define TRACE_STATIC_RINGS 4
+#else
+#define TRACE_RING_SIZE 65536
+#endif
+
+static const char *trace_point_names[TRACE_POINTS] = {
+    "serial_read", "slip_decode", "process_command", "uinput_write"
+};
+
+struct trace_event {
+    uint64_t start_ns;
+    uint32_t duration_ns;
+    uint32_t point;
+};
+
+struct trace_ring {
+    struct trace_event events[TRACE_RING_SIZE];
+    atomic_uint_fast64_t head;
+    atomic_uint_fast64_t tail;
+    atomic_uint_fast64_t dropped;
+    long tid;
+    struct trace_ring *next;
+};
+
+static struct {
+    FILE *file;
+    atomic_int running;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct trace_ring *rings;
+    uint64_t start_ns;
+} tracer = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static _Thread_local struct trace_ring *thread_ring;
+
+#ifdef M8JS_FIXED_FOOTPRINT
+static struct {
+    struct trace_ring rings[TRACE_STATIC_RINGS];
+    int used;
+} pool;
+#endif
+
+/**
+ * Creates the ring buffer of the calling thread and makes it visible to the writer thread. Fixed
+ * footprint builds take it from TRACE_STATIC_RINGS static rings; threads beyond those are not traced.
+ */
+static struct trace_ring *create_ring() {
+#ifdef M8JS_FIXED_FOOTPRINT
+    pthread_mutex_lock(&tracer.lock);
+    if (pool.used == TRACE_STATIC_RINGS) {
+        pthread_mutex_unlock(&tracer.lock);
+        return NULL;
+    }
+    struct trace_ring *ring = &pool.rings[pool.used++];
+#else
+    struct trace_ring *ring = calloc(1, sizeof(struct trace_ring));
+    if (ring == NULL)
+        return NULL;
+    pthread_mutex_lock(&tracer.lock);
+#endif
+    ring->tid = syscall(SYS_gettid);
+    ring->next = tracer.rings;
+    tracer.rings = ring;
+    pthread_mutex_unlock(&tracer.lock);
+    return ring;
+}
+
+/**
+ * Records a span that started at start_ns and ends now. Drops the span if the ring is full.
+ *
+ * @param point The traced stage.
+ * @param start_ns Start time of the span from monotonic_ns().
+ */
+void trace_record(const enum trace_point point, const uint64_t start_ns) {
+    const uint64_t end_ns = monotonic_ns();
+
+    if (!atomic_load_explicit(&tracer.running, memory_order_relaxed))
+        return;
+
+    struct trace_ring *ring = thread_ring;
+    if (ring == NULL && (ring = thread_ring = create_ring()) == NULL)
+        return;
+
+    const uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= TRACE_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    struct trace_event *event = &ring->events[head & (TRACE_RING_SIZE - 1)];
+    event->start_ns = start_ns;
+    event->duration_ns = (uint32_t) (end_ns - start_ns);
+    event->point = point;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+/**
+ * Writes out all events recorded so far.
+ */
+static void drain_rings() {
+    const int pid = getpid();
+
+    pthread_mutex_lock(&tracer.lock);
+    for (struct trace_ring *ring = tracer.rings; ring != NULL; ring = ring->next) {
+        const uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+        for (; tail != head; tail++) {
+            const struct trace_event *event = &ring->events[tail & (TRACE_RING_SIZE - 1)];
+            fprintf(tracer.file,
+                    "{\"name\":\"%s\",\"cat\":\"m8js\",\"ph\":\"X\","
+                    "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%ld},\n",
+                    trace_point_names[event->point], (event->start_ns - tracer.start_ns) / 1e3,
+                    event->duration_ns / 1e3, pid, ring->tid);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    pthread_mutex_unlock(&tracer.lock);
+    fflush(tracer.file);
+}
+
+static void *writer_thread(void *arg) {
+    while (atomic_load(&tracer.running)) {
+        usleep(100000);
+        drain_rings();
+    }
+    return NULL;
+}
+
+/**
+ * Starts tracing to a file.
+ *
+ * @param path Path of the Chrome trace JSON file to write.
+ * @return Returns 1 on success, 0 otherwise.
+ */
+int trace_open(const char *path) {
+    tracer.file = fopen(path, "w");
+    if (tracer.file == NULL) {
+        perror(path);
+        return 0;
+    }
+    fprintf(tracer.file, "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"m8js\"}},\n",
+            getpid());
+
+    tracer.start_ns = monotonic_ns();
+    atomic_store(&tracer.running, 1);
+    if (pthread_create(&tracer.thread, NULL, writer_thread, NULL) != 0) {
+        fprintf(stderr, "Cannot start trace writer thread\n");
+        atomic_store(&tracer.running, 0);
+        fclose(tracer.file);
+        tracer.file = NULL;
+        return 0;
+    }
+    // the main loop's ring is created here rather than on its first event, which would allocate in the loop
+    thread_ring = create_ring();
+    if (thread_ring != NULL)
+        footprint_prefault(thread_ring, sizeof(*thread_ring));
+
+    fprintf(stderr, "Tracing to %s\n", path);
+    return 1;
+}
+
+/**
+ * Stops tracing, writes out the remaining events and frees the ring buffers.
+ */
+void trace_close() {
+    if (tracer.file == NULL)
+        return;
+
+    atomic_store(&tracer.running, 0);
+    pthread_join(tracer.thread, NULL);
+    drain_rings();
+
+    uint64_t dropped = 0;
+    while (tracer.rings != NULL) {
+        struct trace_ring *ring = tracer.rings;
+        dropped += atomic_load(&ring->dropped);
+        tracer.rings = ring->next;
+#ifndef M8JS_FIXED_FOOTPRINT
+        free(ring);
+#endif
+    }
+    thread_ring = NULL;
+
+    fprintf(tracer.file,
+            "{\"name\":\"dropped_events\",\"ph\":\"C\",\"ts\":0,\"pid\":%d,\"args\":{\"dropped\":%llu}}\n]\n",
+            getpid(), (unsigned long long) dropped);
+    fclose(tracer.file);
+    tracer.file = NULL;
+}
@@ -3,6 +3,8 @@
 //
 
 #include "virtualjoystick.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <fcntl.h>
@@ -43,6 +45,10 @@ int initialize_virtual_joystick() {
     ioctl(fd, UI_SET_KEYBIT, BTN_DPAD_LEFT);
     ioctl(fd, UI_SET_KEYBIT, BTN_DPAD_RIGHT);
 
+    // serial arrival time of each joypad packet is passed on as MSC_TIMESTAMP
+    ioctl(fd, UI_SET_EVBIT, EV_MSC);
+    ioctl(fd, UI_SET_MSCBIT, MSC_TIMESTAMP);
+
     struct uinput_setup setup =
     {
         .name = "M8 Virtual Joystick",
@@ -81,8 +87,19 @@ int destroy_virtual_joystick() {
     return 1;
 }
 
-int send_virtual_joystick_message(uint8_t keycode) {
-    struct input_event ev[9] = {0};
+/**
+ * Writes the M8 key state to the virtual joystick.
+ *
+ * The kernel stamps events with the time they are written, so the time the
+ * packet arrived from the M8 is sent along as a MSC_TIMESTAMP event. Like on
+ * other devices reporting it, the value is in microseconds and wraps around.
+ *
+ * @param keycode The M8 key state bits.
+ * @param timestamp_ns Arrival time of the joypad packet in CLOCK_MONOTONIC nanoseconds.
+ * @return Returns 1 if the events were written, otherwise returns 0.
+ */
+int send_virtual_joystick_message(uint8_t keycode, uint64_t timestamp_ns) {
+    struct input_event ev[10] = {0};
 
     ev[0].type = EV_KEY;
     ev[0].code = BTN_DPAD_UP;
@@ -116,15 +133,25 @@ int send_virtual_joystick_message(uint8_t keycode) {
     ev[7].code = BTN_SELECT;
     ev[7].value = (keycode & key_select) > 0;
 
+    ev[8].type = EV_MSC;
+    ev[8].code = MSC_TIMESTAMP;
+    ev[8].value = (int32_t) (uint32_t) (timestamp_ns / 1000);
+
     // Sync message
-    ev[8].type = EV_SYN;
-    ev[8].code = SYN_REPORT;
-    ev[8].value = 0;
+    ev[9].type = EV_SYN;
+    ev[9].code = SYN_REPORT;
+    ev[9].value = 0;
+
+    trace_begin(TRACE_UINPUT_WRITE);
+    const ssize_t result = write(fd, &ev, sizeof ev);
+    trace_end(TRACE_UINPUT_WRITE);
 
-    if (write(fd, &ev, sizeof ev) < 0) {
+    if (result < 0) {
         perror("write");
+        metrics_inc(uinput_write_failures);
         return 0;
     }
 
+    metrics_inc(uinput_writes);
     return 1;
 }
@@ -0,0 +1,140 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+// Stand-in for a M8 on a pseudo terminal. Answers controller messages with the
+// matching joypad state packet like the real device does, so m8js (and its
+// latency probe) can be run without hardware:
+//
+//   m8-pty-stub [delay_us] &
+//   m8js --device /dev/pts/N --probe
+
+#define _GNU_SOURCE
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define SLIP_END 0xC0
+#define SLIP_ESC 0xDB
+#define SLIP_ESC_END 0xDC
+#define SLIP_ESC_ESC 0xDD
+
+static void send_packet(const int fd, const uint8_t *data, const int size, const int delay_us) {
+    uint8_t buf[2 * 512 + 1];
+    int n = 0;
+
+    for (int i = 0; i < size; i++) {
+        if (data[i] == SLIP_END) {
+            buf[n++] = SLIP_ESC;
+            buf[n++] = SLIP_ESC_END;
+        } else if (data[i] == SLIP_ESC) {
+            buf[n++] = SLIP_ESC;
+            buf[n++] = SLIP_ESC_ESC;
+        } else {
+            buf[n++] = data[i];
+        }
+    }
+    buf[n++] = SLIP_END;
+
+    if (delay_us > 0)
+        usleep(delay_us);
+    if (write(fd, buf, n) != n)
+        perror("write");
+}
+
+/**
+ * Sends a small screen: a cleared background, a line of text and a waveform.
+ */
+static void send_screen(const int fd) {
+    const uint8_t clear[12] = {0xFE, 0, 0, 0, 0, 64, 1, 240, 0, 0, 0, 0};
+    send_packet(fd, clear, sizeof(clear), 0);
+
+    const char *text = "M8 PTY STUB";
+    for (int i = 0; text[i] != 0; i++) {
+        const uint16_t x = 8 * i;
+        const uint8_t character[12] = {0xFD, text[i], x & 0xFF, x >> 8, 0, 0, 0xFF, 0xFF, 0xFF, 0, 0, 0};
+        send_packet(fd, character, sizeof(character), 0);
+    }
+
+    uint8_t waveform[4 + 64] = {0xFC, 0x00, 0xFF, 0x00};
+    for (int i = 0; i < 64; i++)
+        waveform[4 + i] = 10 + (i % 16 < 8 ? i % 8 : 8 - i % 8);
+    send_packet(fd, waveform, sizeof(waveform), 0);
+}
+
+int main(const int argc, char *argv[]) {
+    const int delay_us = argc > 1 ? atoi(argv[1]) : 0;
+
+    const int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0) {
+        perror("posix_openpt");
+        return EXIT_FAILURE;
+    }
+
+    struct termios tio;
+    tcgetattr(master, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(master, TCSANOW, &tio);
+
+    // keep the slave side open so reads don't fail while nobody is connected
+    const int slave = open(ptsname(master), O_RDWR | O_NOCTTY);
+    if (slave < 0) {
+        perror("open slave");
+        return EXIT_FAILURE;
+    }
+
+    printf("%s\n", ptsname(master));
+    fflush(stdout);
+
+    // command bytes and the number of argument bytes following them
+    int pending_args = 0;
+    int controller = 0;
+
+    while (1) {
+        uint8_t buf[256];
+        const ssize_t count = read(master, buf, sizeof(buf));
+        if (count <= 0) {
+            struct pollfd pfd = {.fd = master, .events = POLLIN};
+            poll(&pfd, 1, 10);
+            continue;
+        }
+
+        for (ssize_t i = 0; i < count; i++) {
+            const uint8_t byte = buf[i];
+
+            if (pending_args > 0) {
+                pending_args--;
+                if (controller) {
+                    const uint8_t packet[3] = {0xFB, byte, 0};
+                    send_packet(master, packet, sizeof(packet), delay_us);
+                    controller = 0;
+                }
+                continue;
+            }
+
+            switch (byte) {
+                case 'C':
+                    pending_args = 1;
+                    controller = 1;
+                    break;
+                case 'K':
+                    pending_args = 2;
+                    break;
+                case 'R':
+                    send_screen(master);
+                    break;
+                case 'E': {
+                    // headless device, firmware 0.0.0
+                    const uint8_t packet[6] = {0xFF, 0, 0, 0, 0, 0};
+                    send_packet(master, packet, sizeof(packet), 0);
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+    }
+}
@@ -0,0 +1,151 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+// Dumps the key transition journal written by m8js --journal. Works on the
+// journal of a running or crashed m8js, partly written records are skipped.
+//
+//   m8js-journal [-d device] [-k keymask] [-e] [-n count] journal-file
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "journal.h"
+
+static const char *key_names[8] = {"edit", "opt", "right", "start", "select", "down", "up", "left"};
+
+static int compare_records(const void *a, const void *b) {
+    const uint64_t x = (*(const struct journal_record **) a)->sequence;
+    const uint64_t y = (*(const struct journal_record **) b)->sequence;
+    return (x > y) - (x < y);
+}
+
+static void print_keys(const char *label, const uint8_t keys) {
+    if (keys == 0)
+        return;
+    printf(" %s", label);
+    for (int bit = 7; bit >= 0; bit--) {
+        if (keys & 1 << bit)
+            printf(" %s", key_names[bit]);
+    }
+}
+
+static void print_record(const struct journal_header *header, const struct journal_record *record) {
+    const time_t seconds = (time_t) (record->timestamp_ns / 1000000000);
+    struct tm tm;
+    char date[32];
+    localtime_r(&seconds, &tm);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+
+    printf("%s.%06llu %8llu %s 0x%02X -> 0x%02X", date,
+           (unsigned long long) (record->timestamp_ns % 1000000000 / 1000), (unsigned long long) record->sequence,
+           record->device < header->device_count ? header->devices[record->device] : "?", record->old_keys,
+           record->new_keys);
+    print_keys("pressed:", record->new_keys & ~record->old_keys);
+    print_keys("released:", record->old_keys & ~record->new_keys);
+    if (record->flags & JOURNAL_SLIP_OVERFLOW)
+        printf(" [slip overflow]");
+    if (record->flags & JOURNAL_SLIP_BAD_ESCAPE)
+        printf(" [slip bad escape]");
+    if (record->flags & JOURNAL_INVALID_PACKET)
+        printf(" [invalid packet]");
+    if (record->flags & JOURNAL_UINPUT_FAILED)
+        printf(" [uinput write failed]");
+    printf("\n");
+}
+
+int main(const int argc, char *argv[]) {
+    const char *device = NULL;
+    unsigned int key_mask = 0;
+    int errors_only = 0;
+    unsigned long count = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "d:k:en:")) != -1) {
+        switch (opt) {
+            case 'd':
+                device = optarg;
+                break;
+            case 'k':
+                key_mask = strtoul(optarg, NULL, 0);
+                break;
+            case 'e':
+                errors_only = 1;
+                break;
+            case 'n':
+                count = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr,
+                        "Usage: %s [-d device] [-k keymask] [-e] [-n count] journal-file\n"
+                        "  -d device   only show records of this device\n"
+                        "  -k keymask  only show records where one of these M8 keys changed\n"
+                        "  -e          only show records with errors\n"
+                        "  -n count    only show the last count matching records\n",
+                        argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "No journal file given\n");
+        return EXIT_FAILURE;
+    }
+
+    const int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    if ((size_t) st.st_size < sizeof(struct journal_header)) {
+        fprintf(stderr, "%s is not a m8js journal\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    const struct journal_header *header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+    if (header->magic != JOURNAL_MAGIC || header->version != JOURNAL_VERSION ||
+        header->record_size != sizeof(struct journal_record) ||
+        st.st_size < (off_t) (sizeof(struct journal_header) + (size_t) header->capacity * header->record_size)) {
+        fprintf(stderr, "%s is not a m8js journal or has an unsupported version\n", argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    // collect the complete records and order them by sequence number
+    const struct journal_record *records = (const struct journal_record *) (header + 1);
+    const struct journal_record **valid = calloc(header->capacity, sizeof(*valid));
+    uint32_t valid_count = 0;
+    for (uint32_t i = 0; i < header->capacity; i++) {
+        const uint64_t sequence = __atomic_load_n(&records[i].sequence, __ATOMIC_ACQUIRE);
+        if (sequence != 0 && (sequence - 1) % header->capacity == i)
+            valid[valid_count++] = &records[i];
+    }
+    qsort(valid, valid_count, sizeof(*valid), compare_records);
+
+    // apply the filters
+    uint32_t matching = 0;
+    for (uint32_t i = 0; i < valid_count; i++) {
+        const struct journal_record *record = valid[i];
+        if (device != NULL && (record->device >= header->device_count ||
+                               strcmp(header->devices[record->device], device) != 0))
+            continue;
+        if (key_mask != 0 && ((record->old_keys ^ record->new_keys) & key_mask) == 0)
+            continue;
+        if (errors_only && record->flags == 0)
+            continue;
+        valid[matching++] = record;
+    }
+
+    for (uint32_t i = count != 0 && count < matching ? matching - count : 0; i < matching; i++)
+        print_record(header, valid[i]);
+
+    free(valid);
+    return EXIT_SUCCESS;
+}
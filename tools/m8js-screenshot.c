@@ -0,0 +1,93 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+// Saves the screen mirrored by m8js --display-shm as a PPM image. Also shows
+// how to read the display mirror: see display_copy_changes() in display.h.
+//
+//   m8js-screenshot [-n shm-name] output.ppm
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "demand.h"
+#include "display.h"
+
+static uint32_t pixels[DISPLAY_MAX_WIDTH * DISPLAY_MAX_HEIGHT];
+
+int main(const int argc, char *argv[]) {
+    const char *name = DISPLAY_SHM_NAME;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        if (opt != 'n') {
+            fprintf(stderr, "Usage: %s [-n shm-name] output.ppm\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        name = optarg;
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "No output file given\n");
+        return EXIT_FAILURE;
+    }
+
+    const int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        perror(name);
+        return EXIT_FAILURE;
+    }
+    const struct display_header *header = mmap(NULL, sizeof(*header), PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+    if (header->magic != DISPLAY_MAGIC || header->version != DISPLAY_VERSION) {
+        fprintf(stderr, "%s is not a m8js display mirror or has an unsupported version\n", name);
+        return EXIT_FAILURE;
+    }
+
+    // ask m8js for the screen and give it time to get a redraw from the M8
+    flock(fd, LOCK_SH);
+    uint64_t frame_number = 0;
+    int copied = display_copy_changes(header, pixels, &frame_number);
+    const uint64_t attached_frame = frame_number;
+    for (int i = 0; i < DEMAND_ATTACH_WAIT_MS / 10 && frame_number == attached_frame; i++) {
+        nanosleep(&(struct timespec){0, 10000000}, NULL);
+        copied = display_copy_changes(header, pixels, &frame_number);
+    }
+    // let the last redraw finish
+    for (int i = 0; i < 10; i++) {
+        nanosleep(&(struct timespec){0, 20000000}, NULL);
+        copied = display_copy_changes(header, pixels, &frame_number);
+    }
+    for (int i = 0; i < 100 && copied < 0; i++) {
+        nanosleep(&(struct timespec){0, 10000000}, NULL);
+        copied = display_copy_changes(header, pixels, &frame_number);
+    }
+    if (copied < 0) {
+        fprintf(stderr, "No complete frame in %s, m8js may have stopped while writing one\n", name);
+        return EXIT_FAILURE;
+    }
+
+    FILE *out = fopen(argv[optind], "wb");
+    if (out == NULL) {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    fprintf(out, "P6\n%u %u\n255\n", header->width, header->height);
+    for (uint32_t y = 0; y < header->height; y++) {
+        for (uint32_t x = 0; x < header->width; x++) {
+            const uint32_t p = pixels[y * DISPLAY_MAX_WIDTH + x];
+            const uint8_t rgb[3] = {p >> 16, p >> 8, p};
+            fwrite(rgb, 1, sizeof(rgb), out);
+        }
+    }
+    fclose(out);
+
+    printf("Saved frame %llu (%ux%u) to %s\n", (unsigned long long) frame_number, header->width, header->height,
+           argv[optind]);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,111 @@
+// Released under the MIT licence, https://opensource.org/licenses/MIT
+
+// Prints the rows of the text grid published by m8js --textgrid-shm whenever
+// they change. Also shows how to follow the grid: see textgrid_wait() and
+// textgrid_read_rows() in textgrid.h.
+//
+//   m8js-textgrid [-n shm-name] [-1]
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "demand.h"
+#include "textgrid.h"
+
+// times the tool backs off when textgrid_read_rows() gives up, before it gives up itself
+#define READ_RETRIES 100
+
+static struct textgrid_cell cells[TEXTGRID_MAX_ROWS][TEXTGRID_MAX_COLUMNS];
+
+static void print_row(const uint32_t columns, const uint32_t row) {
+    char text[TEXTGRID_MAX_COLUMNS + 1];
+    for (uint32_t column = 0; column < columns; column++) {
+        const uint8_t c = cells[row][column].c;
+        text[column] = c >= 0x20 && c < 0x7F ? c : ' ';
+    }
+    text[columns] = 0;
+    printf("%2u|%s|\n", row, text);
+}
+
+int main(const int argc, char *argv[]) {
+    const char *name = TEXTGRID_SHM_NAME;
+    int once = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:1")) != -1) {
+        switch (opt) {
+            case 'n':
+                name = optarg;
+                break;
+            case '1':
+                once = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n shm-name] [-1]\n  -1  print the whole grid once and exit\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    // mapped writable to register as a waiter
+    const int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        perror(name);
+        return EXIT_FAILURE;
+    }
+    struct textgrid_header *header = mmap(NULL, sizeof(*header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+    if (header->magic != TEXTGRID_MAGIC || header->version != TEXTGRID_VERSION) {
+        fprintf(stderr, "%s is not a m8js text grid or has an unsupported version\n", name);
+        return EXIT_FAILURE;
+    }
+
+    // ask m8js for the screen and give it time to get a redraw from the M8, the lock is released on exit
+    flock(fd, LOCK_SH);
+    uint32_t attached = __atomic_load_n(&header->generation, __ATOMIC_ACQUIRE);
+    if (textgrid_wait(header, attached, DEMAND_ATTACH_WAIT_MS)) {
+        // let the redraw finish
+        for (int i = 0; i < 10; i++) {
+            attached = __atomic_load_n(&header->generation, __ATOMIC_ACQUIRE);
+            if (!textgrid_wait(header, attached, 20))
+                break;
+        }
+    }
+
+    // start from generation 0 to get every row that has been drawn
+    uint32_t generation = 0;
+    int retries = 0;
+    do {
+        uint32_t rows;
+        if (textgrid_read_rows(header, cells, &generation, &rows) < 0) {
+            if (++retries == READ_RETRIES) {
+                fprintf(stderr, "No consistent text grid in %s, m8js may have stopped while updating it\n", name);
+                return EXIT_FAILURE;
+            }
+            nanosleep(&(struct timespec){0, 10000000}, NULL);
+            continue;
+        }
+        retries = 0;
+
+        const uint32_t columns = header->columns < TEXTGRID_MAX_COLUMNS ? header->columns : TEXTGRID_MAX_COLUMNS;
+        for (uint32_t row = 0; row < header->rows && row < TEXTGRID_MAX_ROWS; row++) {
+            if (rows & 1u << row)
+                print_row(columns, row);
+        }
+        fflush(stdout);
+        if (once)
+            break;
+
+        while (!textgrid_wait(header, generation, 1000)) {
+        }
+    } while (1);
+
+    return EXIT_SUCCESS;
+}